@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2015
+ *      The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <omp.h>
+#include <unistd.h>
+
+#include <defs.h>
+#include <graph_wrapper.h>
+#include <jtree.h>
+#include <partition.h>
+#include <sequence.h>
+
+/* This is scripts/horizontal-dist.sh as a single process.
+ * Every stage is an OpenMP task, and a task starts the moment its inputs exist:
+ * partial graphs load while the sequence is sorted, and partial trees merge in the order they finish.
+ * Trees are handed from stage to stage in memory, so nothing waits on a file or a polling loop. */
+int main(int argc, char* argv[]) {
+  size_t workers = 2;
+  int cores = omp_get_max_threads();
+  char const *sequence_filename = "";
+  char const *sequence_output_filename = "";
+  char const *tree_filename = "";
+  char const *output_filename = "";
+  bool mirror_tables = false;
+
+  double balance_factor = 1.03;
+  bool verbose = false;
+  bool do_faqs = false;
+  bool parallel_partition = false;
+
+  opterr = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:c:s:S:t:o:b:Rpvf")) != -1) {
+    switch (opt) {
+      case 'w':
+        workers = atoll(optarg);
+        break;
+      case 'c':
+        cores = atoi(optarg);
+        break;
+      case 's':
+        sequence_filename = optarg;
+        break;
+      case 'S':
+        sequence_output_filename = optarg;
+        break;
+      case 't':
+        tree_filename = optarg;
+        break;
+      case 'o':
+        output_filename = optarg;
+        break;
+      case 'b':
+        balance_factor = atof(optarg);
+        break;
+      case 'R':
+        mirror_tables = !mirror_tables;
+        break;
+      case 'p':
+        parallel_partition = !parallel_partition;
+        break;
+      case 'v':
+        verbose = !verbose;
+        break;
+      case 'f':
+        do_faqs = !do_faqs;
+        break;
+      case '?':
+        if (optopt == 'w' || optopt == 'c')
+          printf("Option -%c requires a long long.\n", optopt);
+        else if (optopt == 'b')
+          printf("Option -%c requires a double.\n", optopt);
+        else if (optopt == 's' || optopt == 'S' || optopt == 't' || optopt == 'o')
+          printf("Option -%c requires a string.\n", optopt);
+        else
+          printf("Unknown option character '\\x%x'.\n", optopt);
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if (optind >= argc || workers == 0 || cores <= 0) {
+    printf("USAGE: dist_partition [options ...] input_graph [parts ...]\n");
+    return 1;
+  }
+  char const *const graph_filename = argv[optind];
+  if (strcmp(sequence_filename, "") != 0 && strcmp(sequence_output_filename, "") != 0) {
+    printf("-S writes the degree sequence, so it cannot be combined with -s.\n");
+    return 1;
+  }
+
+  // As in part-worker.sh, a part count of 0 skips partitioning. -o writes a single partition.
+  std::vector<part_t> part_counts;
+  for (int i = optind + 1; i != argc; ++i) {
+    char *end;
+    long long const count = strtoll(argv[i], &end, 10);
+    if (end == argv[i] || *end != '\0' || count < 0 || count > std::numeric_limits<part_t>::max()) {
+      printf("Cannot make %s parts; part counts must be integers from 0 to %lld.\n",
+          argv[i], (long long) std::numeric_limits<part_t>::max());
+      return 1;
+    }
+    if (count != 0)
+      part_counts.push_back(count);
+  }
+  if (strcmp(output_filename, "") != 0 && part_counts.size() > 1) {
+    printf("Cannot write %zu partitions to %s; -o takes a single part count.\n", part_counts.size(), output_filename);
+    return 1;
+  }
+
+  auto start_point = std::chrono::steady_clock::now();
+  auto seconds_since = [](std::chrono::steady_clock::time_point const point) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - point).count() / 1000.0;
+  };
+
+  std::vector<vid_t> seq;
+  // Task dependences need plain arrays, not vectors.
+  std::vector<GraphWrapper*> graph_slots(workers, nullptr);
+  GraphWrapper **const graphs = graph_slots.data();
+  JNodeTable *waiting = nullptr;
+  double sort_seconds = 0;
+  double map_seconds = 0;
+
+  #pragma omp parallel num_threads(cores)
+  #pragma omp single
+  {
+    #pragma omp task depend(out: seq) shared(seq, sort_seconds)
+    {
+      seq = strcmp(sequence_filename, "") != 0 ?
+        readSequence(sequence_filename) :
+        fileSequence(graph_filename);
+      sort_seconds = seconds_since(start_point);
+      // Like sort-worker.sh, so later partition_tree runs can reuse it.
+      if (strcmp(sequence_output_filename, "") != 0)
+        writeSequence(seq, sequence_output_filename);
+    }
+
+    for (size_t w = 0; w != workers; ++w) {
+      // A partial loads once the partial `cores` before it is built, so at most `cores` are ever resident.
+      size_t const prev = w >= (size_t) cores ? w - cores : w;
+
+      //XXX Every partial opens its own LLAMA database; they are in-memory, so this is safe but not free.
+      #pragma omp task depend(in: graphs[prev]) depend(out: graphs[w])
+      {
+        if (verbose) printf("MAP %zu: loading %s...\n", w, graph_filename);
+        graphs[w] = new GraphWrapper(graph_filename, w + 1, workers);
+      }
+
+      #pragma omp task depend(in: seq) depend(inout: graphs[w]) shared(seq, map_seconds, waiting)
+      {
+        JTree tree(*graphs[w], seq, JTree::Options());
+        delete graphs[w];
+        JNodeTable *jnodes = new JNodeTable(std::move(tree.jnodes));
+
+        double const seconds = seconds_since(start_point);
+        #pragma omp critical(dist_partition_map)
+        map_seconds = std::max(map_seconds, seconds);
+        if (verbose) printf("MAP %zu: built in %f seconds\n", w, seconds);
+
+        // Reduce in completion order: park the tree for the next finisher, or merge with the one parked.
+        for (;;) {
+          JNodeTable *other = nullptr;
+          #pragma omp critical(dist_partition_reduce)
+          {
+            if (waiting == nullptr)
+              waiting = jnodes;
+            else
+              std::swap(other, waiting);
+          }
+          if (other == nullptr)
+            break;
+
+          jnodes->zipMerge(*other);
+          delete other;
+          if (verbose) printf("REDUCE %zu: merged a tree\n", w);
+        }
+      }
+    }
+  }
+
+  printf("Sorted in: %f seconds\n", sort_seconds);
+  printf("Mapped in: %f seconds\n", map_seconds);
+  printf("Reduced in: %f seconds\n", seconds_since(start_point) - map_seconds);
+
+  JNodeTable &jnodes = *waiting;
+  if (strcmp(tree_filename, "") != 0)
+    jnodes.save(tree_filename);
+  if (do_faqs)
+    jnodes.getFacts().print();
+
+  if (!part_counts.empty()) {
+    auto partition_start = std::chrono::steady_clock::now();
+
+    //XXX Unfortunate hack; Partition requires kids, which are normally made on-load.
+    jnodes.makeKids();
+
+    if (strcmp(output_filename, "") != 0) {
+      Partition part(seq, jnodes, part_counts[0], balance_factor, false, true, false, parallel_partition);
+      part.print();
+      part.writePartitionedGraph(graph_filename, seq, output_filename);
+      if (mirror_tables)
+        part.writeMirrorTables(graph_filename, seq, output_filename);
+    }
+    else {
+      GraphWrapper graph(graph_filename);
+      for (part_t const count : part_counts) {
+        Partition part(seq, jnodes, count, balance_factor, false, true, false, parallel_partition);
+        part.print();
+        part.evaluate(graph, seq);
+      }
+    }
+
+    printf("Partitioned in: %f seconds\n", seconds_since(partition_start));
+  }
+  delete waiting;
+
+  if (verbose) printf("Finished in: %f seconds\n", seconds_since(start_point));
+  return 0;
+}
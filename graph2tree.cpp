@@ -44,10 +44,12 @@
 int main(int argc, char* argv[]) {
   bool use_mpi_sort = false;
   bool use_mpi_reduce = false;
+  bool use_async_reduce = false;
 
   size_t part = 0;
   size_t num_parts = 0;
   size_t partitions = 0;
+  bool parallel_partition = false;
   char const *sequence_filename = "";
   char const *output_filename = "";
 
@@ -58,7 +60,7 @@ int main(int argc, char* argv[]) {
 
   opterr = 0;
   int opt;
-  while ((opt = getopt(argc, argv, "irl:p:s:o:vkejm:w:xfdtc")) != -1) {
+  while ((opt = getopt(argc, argv, "iral:p:qs:o:vkejm:w:xfdtc")) != -1) {
     switch (opt) {
       case 'i':
         use_mpi_sort = !use_mpi_sort;
@@ -66,6 +68,9 @@ int main(int argc, char* argv[]) {
       case 'r':
         use_mpi_reduce = !use_mpi_reduce;
         break;
+      case 'a':
+        use_async_reduce = !use_async_reduce;
+        break;
       case 'l':
         part=atoll(strtok(optarg, "/"));
         num_parts=atoll(strtok(nullptr, "/"));
@@ -74,6 +79,9 @@ int main(int argc, char* argv[]) {
       case 'p':
         partitions=atoll(optarg);
         break;
+      case 'q':
+        parallel_partition = !parallel_partition;
+        break;
       case 's':
         sequence_filename = optarg;
         break;
@@ -128,6 +136,8 @@ int main(int argc, char* argv[]) {
     return 1;
   }
   char const *const graph_filename = argv[optind];
+  if (use_async_reduce)
+    use_mpi_reduce = true;
   
   auto start_point = std::chrono::steady_clock::now();
 
@@ -182,8 +192,12 @@ int main(int argc, char* argv[]) {
   if (is_leader && (use_mpi_sort || strcmp(sequence_filename, "") == 0))
     printf("Sorted in: %f seconds\n", sort_duration.count() / 1000.0);
 
+  // The asynchronous reduce needs a collective window, which can't wait until after the map.
+  MPI_Win reduce_win = use_async_reduce ? JNodeTable::mpi_async_window() : MPI_WIN_NULL;
+
+  // Partial trees are mostly untouched jnodes, so they are built in memory and saved sparse.
   JTree tree =
-    !use_mpi_reduce && strcmp(output_filename, "") != 0 && partitions == 0 ?
+    num_parts == 0 && strcmp(output_filename, "") != 0 && partitions == 0 ?
       JTree(graph, seq, output_filename, jopts) :
     //else
       JTree(graph, seq, jopts);
@@ -193,7 +207,10 @@ int main(int argc, char* argv[]) {
   if (is_leader) printf("Mapped in: %f seconds\n", map_duration.count() / 1000.0);
 
   if (use_mpi_reduce) {
-    tree.jnodes.mpi_merge(jopts.make_kids);
+    if (use_async_reduce)
+      tree.jnodes.mpi_async_merge(reduce_win, jopts.make_kids);
+    else
+      tree.jnodes.mpi_merge(jopts.make_kids);
 
     auto reduce_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::steady_clock::now() - start_point) - map_duration - sort_duration - load_duration;
@@ -205,7 +222,7 @@ int main(int argc, char* argv[]) {
     if (!use_mpi_reduce || part == 1)
       tree.jnodes.makeKids();
     Partition p = !use_mpi_reduce || part == 1 ?
-      Partition(seq, tree.jnodes, partitions) : Partition();
+      Partition(seq, tree.jnodes, partitions, 1.03, false, true, false, parallel_partition) : Partition();
     if (use_mpi_reduce)
       p.mpi_sync();
 
@@ -214,7 +231,7 @@ int main(int argc, char* argv[]) {
     else if (is_leader)
       p.print();
   }
-  else if (use_mpi_reduce && part == 1 && strcmp(output_filename, "") != 0)
+  else if (strcmp(output_filename, "") != 0 && (use_mpi_reduce ? part == 1 : num_parts != 0))
     tree.jnodes.save(output_filename);
 
   if (use_mpi_sort || use_mpi_reduce)
@@ -30,6 +30,8 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 
 
 /* COMPILE-TIME OPTIONS:
@@ -62,6 +64,12 @@
 //#define USE_PRE_WEIGHT
 
 
+/* OPTION: Use 32-bit part ids instead of 16-bit ones.
+ * This is needed for more than 32767 parts,
+ * but it doubles the size of every partition in memory and over MPI. */
+//#define USE_WIDE_PARTS
+
+
 /* OPTION: Use LLAMA or SNAP for storage.
  * BE WARNED: LLAMA vastly outperforms SNAP,
  * and SNAP has not been tested in quite some time. */
@@ -81,8 +89,43 @@ typedef size_t esize_t;
 #endif
 #define INVALID_VID ((vid_t)-1)
 
+#ifdef USE_WIDE_PARTS
+typedef int32_t part_t;
+#else
+typedef short part_t;
+#endif
+#define INVALID_PART (part_t)-1
+
 
 #define KILO (1024)
 #define MEGA (1024 * KILO)
 #define GIGA (1024 * MEGA)
 
+
+
+/* CHECKSUMS
+ * An order-sensitive sum of mixed words, so it can be computed in parallel and a section at a time.
+ * first_word is the index of data's first word within the checksummed range.
+ * Tree files and partition indexes both use it. */
+static inline uint64_t checksum(char const *const data, size_t const len, uint64_t const first_word) {
+  auto mix = [](uint64_t X) {
+    X ^= X >> 30; X *= 0xbf58476d1ce4e5b9ULL;
+    X ^= X >> 27; X *= 0x94d049bb133111ebULL;
+    return X ^ (X >> 31);
+  };
+
+  size_t const num_words = len / 8;
+  uint64_t sum = 0;
+  #pragma omp parallel for reduction(+:sum)
+  for (size_t i = 0; i < num_words; ++i) {
+    uint64_t word;
+    memcpy(&word, data + 8 * i, 8);
+    sum += mix(word + (first_word + i) * 0x9e3779b97f4a7c15ULL);
+  }
+  if (len % 8 != 0) {
+    uint64_t word = 0;
+    memcpy(&word, data + 8 * num_words, len % 8);
+    sum += mix(word + (first_word + num_words) * 0x9e3779b97f4a7c15ULL);
+  }
+  return sum;
+}
@@ -30,8 +30,10 @@
 #include "jnode.h"
 
 #include <cstring>
+#include <limits>
 
 #include <fcntl.h>
+#include <omp.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -40,100 +42,530 @@
  * CONSTRUCTORS AND I/O
  */
 JNodeTable::JNodeTable(jnid_t max_jnids, bool init_kids, size_t memory_limit) :
-  nodes_state(State::ALLOCATED), end_id(0),
+  nodes_state(State::ALLOCATED), map_fd(-1), file_map(nullptr), file_bytes(0), end_id(0),
   max_id(max_jnids), nodes((JNode*)malloc(sizeof(JNode) * max_id)),
-  kid_data(init_kids ? max_id : 0), pst_data(max_id, memory_limit), jxn_data(max_id, memory_limit),
+  kid_data(init_kids ? max_id : 0), kid_offsets(nullptr), kid_ids(nullptr), pst_data(max_id, memory_limit), jxn_data(max_id, memory_limit),
   roots(max_id)
 {
   if (nodes == nullptr)
     throw std::bad_alloc();
 }
 
+/* TREE FILE FORMAT
+ * A tree file is a TreeHeader followed by its sections, in TreeSection order, each padded to whole words.
+ * Only the nodes section is mandatory. It holds either the raw JNode array or, if TREE_SPARSE is set,
+ * the varint records described at encode(). The kid, pst and jxn sections are CSR: end_id + 1 uint64_t
+ * offsets followed by the elements. The checksum covers every byte after the header. */
+#define TREE_MAGIC 0x4552545045454853ULL // "SHEEPTRE"
+#define TREE_VERSION 1
+
+#define TREE_PRE_WEIGHT 0x1
+#define TREE_SPARSE     0x2
+
+enum TreeSection { NODE_SECTION, KID_SECTION, PST_SECTION, JXN_SECTION, NUM_SECTIONS };
+
+struct TreeHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t fields;
+  uint32_t id_width;
+  uint32_t weight_width;
+  uint64_t node_count;
+  uint64_t section_bytes[NUM_SECTIONS];
+  uint64_t checksum;
+
+  inline TreeHeader() :
+    magic(TREE_MAGIC), version(TREE_VERSION), fields(0),
+    id_width(sizeof(jnid_t)), weight_width(sizeof(esize_t)), node_count(0), section_bytes(), checksum(0)
+  {
+    #ifdef USE_PRE_WEIGHT
+      fields |= TREE_PRE_WEIGHT;
+    #endif
+  }
+
+  static inline uint64_t padded(uint64_t const bytes) { return (bytes + 7) & ~(uint64_t)7; }
+
+  inline uint64_t section_offset(int const section) const {
+    uint64_t offset = sizeof(TreeHeader);
+    for (int s = 0; s != section; ++s)
+      offset += padded(section_bytes[s]);
+    return offset;
+  }
+  inline uint64_t file_bytes() const { return section_offset(NUM_SECTIONS); }
+  // Sections no larger than the file can't wrap the sum in file_bytes().
+  inline bool fits(uint64_t const bytes) const {
+    for (int s = 0; s != NUM_SECTIONS; ++s)
+      if (section_bytes[s] > bytes)
+        return false;
+    return file_bytes() == bytes;
+  }
+};
+
 JNodeTable::JNodeTable(char const *filename, jnid_t max_jnids, bool init_kids, size_t memory_limit) :
-  nodes_state(State::MAPPED), end_id(0), max_id(max_jnids), nodes(nullptr),
-  kid_data(init_kids ? max_id : 0), pst_data(max_id, memory_limit), jxn_data(max_id, memory_limit),
+  nodes_state(State::MAPPED), map_fd(-1), file_map(nullptr), file_bytes(0),
+  end_id(0), max_id(max_jnids), nodes(nullptr),
+  kid_data(init_kids ? max_id : 0), kid_offsets(nullptr), kid_ids(nullptr), pst_data(max_id, memory_limit), jxn_data(max_id, memory_limit),
   roots(max_id)
 {
-  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 00666);
-  if (fd == -1)
+  map_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 00666);
+  if (map_fd == -1)
     throw std::bad_alloc();
 
-  if (posix_fallocate(fd, 0, sizeof(jnid_t) + sizeof(JNode) * max_id) != 0) {
-    close(fd);
+  // Padded, so the destructor can zero the tail of the last word.
+  size_t const map_bytes = sizeof(TreeHeader) + TreeHeader::padded(sizeof(JNode) * max_id);
+  if (posix_fallocate(map_fd, 0, map_bytes) != 0) {
+    close(map_fd);
     throw std::bad_alloc();
   }
 
-  char *const nodes_map = (char*)mmap(nullptr, sizeof(jnid_t) + sizeof(JNode) * max_id,
-        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char *const nodes_map = (char*)mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
   if (nodes_map == MAP_FAILED) {
-    close(fd);
+    close(map_fd);
     throw std::bad_alloc();
   }
-  close(fd);
-  nodes = (JNode*)(nodes_map + sizeof(jnid_t));
+  nodes = (JNode*)(nodes_map + sizeof(TreeHeader));
+}
+
+static inline void put_varint(std::vector<char> &buf, uint64_t X) {
+  for (; X >= 0x80; X >>= 7)
+    buf.push_back((char)(X | 0x80));
+  buf.push_back((char)X);
+}
+
+// Returns false if the varint runs past end or past 64 bits.
+static inline bool get_varint(char const *&itr, char const *const end, uint64_t &X) {
+  X = 0;
+  for (unsigned shift = 0; itr != end && shift < 64; shift += 7) {
+    unsigned char const byte = *itr++;
+    X |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80)
+      return true;
+  }
+  return false;
+}
+
+// Calls visit(id, parent, pst_weight, pre_weight) for every record; untouched jnodes are skipped.
+// has_pre says whether the records carry a pre_weight, which need not match this build.
+// Returns false, before visiting it, at the first record that is cut off, names a jnode or parent
+// at or past count, or has a weight past esize_t's limit.
+template <typename Visitor>
+static inline bool decode(jnid_t const beg, jnid_t const count, char const *itr, char const *const end,
+    Visitor visit, bool const has_pre = (TreeHeader().fields & TREE_PRE_WEIGHT) != 0) {
+  uint64_t const limit = count;
+  uint64_t const max_weight = std::numeric_limits<esize_t>::max();
+  uint64_t next = beg;
+  while (itr < end) {
+    uint64_t skip, delta, pst_weight, pre_weight = 0;
+    if (!get_varint(itr, end, skip) || !get_varint(itr, end, delta) || !get_varint(itr, end, pst_weight) ||
+        (has_pre && !get_varint(itr, end, pre_weight)))
+      return false;
+    if (skip >= limit || next + skip >= limit || delta >= limit || next + skip + delta >= limit ||
+        pst_weight > max_weight || pre_weight > max_weight)
+      return false;
+    uint64_t const id = next + skip;
+    visit((jnid_t) id, delta == 0 ? INVALID_JNID : (jnid_t)(id + delta), (esize_t) pst_weight, (esize_t) pre_weight);
+    next = id + 1;
+  }
+  return true;
+}
+
+bool JNodeTable::encode(jnid_t const beg, jnid_t const end, std::vector<char> &buf, size_t const max_len) const
+{
+  jnid_t next = beg;
+  for (jnid_t id = beg; id != end; ++id) {
+    if (parent(id) == INVALID_JNID && pst_weight(id) == 0 && pre_weight(id) == 0)
+      continue;
+    put_varint(buf, id - next);
+    put_varint(buf, parent(id) == INVALID_JNID ? 0 : parent(id) - id);
+    put_varint(buf, pst_weight(id));
+    #ifdef USE_PRE_WEIGHT
+    put_varint(buf, pre_weight(id));
+    #endif
+    next = id + 1;
+
+    if (buf.size() > max_len)
+      return false;
+  }
+  return true;
+}
+
+//XXX Like merge() without kids, this does not carry pre_weight over.
+void JNodeTable::zipEncoded(jnid_t const beg, char const *const itr, char const *const end,
+    std::vector<jnid_t> &jump)
+{
+  bool const valid = decode(beg, size(), itr, end,
+      [&jump,this](jnid_t const id, jnid_t const par, esize_t const pst, esize_t) {
+    pst_weight(id) += pst;
+    if (par != INVALID_JNID)
+      zip(id, par, jump);
+  });
+  if (!valid) {
+    fprintf(stderr, "ERROR: a received partial tree is corrupt.\n");
+    throw std::bad_alloc();
+  }
+}
+
+// Offsets and elements go in one buffer, so a section's padding lands after both.
+template <typename DataType>
+static bool csrSection(JDataTable<DataType> const &table, jnid_t const count, std::vector<char> &bytes) {
+  if (table.size() != count || count == 0)
+    return false;
+  std::vector<uint64_t> offsets(count + 1, 0);
+  for (jnid_t id = 0; id != count; ++id)
+    offsets[id + 1] = offsets[id] + table[id].size();
+
+  bytes.resize(sizeof(uint64_t) * offsets.size() + sizeof(DataType) * offsets[count]);
+  memcpy(bytes.data(), offsets.data(), sizeof(uint64_t) * offsets.size());
+  DataType *itr = (DataType*)(bytes.data() + sizeof(uint64_t) * offsets.size());
+  for (jnid_t id = 0; id != count; ++id)
+    itr = std::copy(table[id].cbegin(), table[id].cend(), itr);
+  return true;
+}
+
+/* Kids are grouped by parent with a parallel counting sort: count, scan, then scatter.
+ * The scatter races within a group, so each group is sorted afterwards; kids always come out
+ * in ascending order, as a serial pass would leave them. */
+static void groupKids(JNodeTable const &table, jnid_t const count,
+    std::vector<uint64_t> &offsets, std::vector<jnid_t> &kid_ids)
+{
+  int const num_threads = count >= 64 * KILO ? omp_get_max_threads() : 1;
+  offsets.assign(count + 1, 0);
+
+  #pragma omp parallel for num_threads(num_threads)
+  for (jnid_t id = 0; id < count; ++id) {
+    if (table.parent(id) != INVALID_JNID) {
+      #pragma omp atomic
+      offsets[table.parent(id) + 1] += 1;
+    }
+  }
+
+  std::vector<uint64_t> chunk_base(num_threads + 1, 0);
+  #pragma omp parallel num_threads(num_threads)
+  {
+    int const thread = omp_get_thread_num();
+    jnid_t const beg = (size_t) count * thread / num_threads + 1;
+    jnid_t const end = (size_t) count * (thread + 1) / num_threads + 1;
+    for (jnid_t id = beg; id < end; ++id)
+      chunk_base[thread + 1] += offsets[id];
+
+    #pragma omp barrier
+    #pragma omp single
+    for (int t = 0; t != num_threads; ++t)
+      chunk_base[t + 1] += chunk_base[t];
+
+    uint64_t sum = chunk_base[thread];
+    for (jnid_t id = beg; id < end; ++id)
+      offsets[id] = sum += offsets[id];
+  }
+
+  kid_ids.resize(offsets[count]);
+  std::vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+  #pragma omp parallel for num_threads(num_threads)
+  for (jnid_t id = 0; id < count; ++id) {
+    jnid_t const parent = table.parent(id);
+    if (parent != INVALID_JNID) {
+      uint64_t slot;
+      #pragma omp atomic capture
+      slot = cursor[parent]++;
+      kid_ids[slot] = id;
+    }
+  }
+
+  if (num_threads > 1) {
+    #pragma omp parallel for schedule(dynamic, 4 * KILO)
+    for (jnid_t id = 0; id < count; ++id)
+      std::sort(kid_ids.begin() + offsets[id], kid_ids.begin() + offsets[id + 1]);
+  }
+}
+
+static void kidSection(JNodeTable const &table, jnid_t const count, std::vector<char> &bytes) {
+  std::vector<uint64_t> offsets;
+  std::vector<jnid_t> kid_ids;
+  groupKids(table, count, offsets, kid_ids);
+
+  bytes.resize(sizeof(uint64_t) * offsets.size() + sizeof(jnid_t) * kid_ids.size());
+  memcpy(bytes.data(), offsets.data(), sizeof(uint64_t) * offsets.size());
+  memcpy(bytes.data() + sizeof(uint64_t) * offsets.size(), kid_ids.data(), sizeof(jnid_t) * kid_ids.size());
+}
+
+void JNodeTable::makeKids() {
+  kid_data = std::move(JDataTable<jnid_t>(0));
+  groupKids(*this, size(), kid_offset_data, kid_id_data);
+  kid_offsets = kid_offset_data.data();
+  kid_ids = kid_id_data.data();
+}
+
+// Reads an unsigned integer written width bytes wide, which need not match this build.
+static inline uint64_t get_width(char const *const data, uint32_t const width) {
+  if (width == sizeof(uint32_t)) {
+    uint32_t X;
+    memcpy(&X, data, sizeof(uint32_t));
+    return X;
+  }
+  uint64_t X;
+  memcpy(&X, data, sizeof(uint64_t));
+  return X;
 }
 
-JNodeTable::JNodeTable(char const *filename) :
-  nodes_state(State::MAPPED), end_id(0), max_id(0), nodes(nullptr),
-  kid_data(0), pst_data(0), jxn_data(0), roots(0)
+// Elements were written width bytes wide. Returns false if the section is malformed or an element
+// is past DataType's limit.
+template <typename DataType>
+static bool readSection(char const *const section, uint64_t const bytes, jnid_t const count, uint32_t const width,
+    JDataTable<DataType> &table) {
+  uint64_t const *const offsets = (uint64_t const*)section;
+  char const *const data = (char const*)(offsets + count + 1);
+  uint64_t const offsets_bytes = sizeof(uint64_t) * ((uint64_t) count + 1);
+  if (bytes < offsets_bytes || offsets[0] != 0 || offsets[count] > (bytes - offsets_bytes) / width ||
+      bytes != offsets_bytes + width * offsets[count])
+    return false;
+
+  table = JDataTable<DataType>(count, sizeof(JData<DataType>) * (count + 1) + sizeof(DataType) * offsets[count]);
+  for (jnid_t id = 0; id != count; ++id) {
+    if (offsets[id] > offsets[id + 1] || offsets[id + 1] > offsets[count])
+      return false;
+    table.newJData(offsets[id + 1] - offsets[id]);
+    for (uint64_t i = offsets[id]; i != offsets[id + 1]; ++i) {
+      uint64_t const element = get_width(data + width * i, width);
+      if (element > (uint64_t) std::numeric_limits<DataType>::max())
+        return false;
+      table[id].push_back((DataType) element);
+    }
+  }
+  return true;
+}
+
+// The kid section is used in place, so its size must match its offsets. This reads only its last offset.
+// Kids of another width are rebuilt instead, so they are not checked.
+static bool kidSectionFits(TreeHeader const &header, char const *const map) {
+  uint64_t const bytes = header.section_bytes[KID_SECTION];
+  if (bytes == 0 || header.id_width != sizeof(jnid_t))
+    return true;
+  uint64_t const offsets_bytes = sizeof(uint64_t) * (header.node_count + 1);
+  if (bytes < offsets_bytes)
+    return false;
+  uint64_t const *const offsets = (uint64_t const*)(map + header.section_offset(KID_SECTION));
+  return offsets[0] == 0 && offsets[header.node_count] <= (bytes - offsets_bytes) / sizeof(jnid_t) &&
+    bytes == offsets_bytes + sizeof(jnid_t) * offsets[header.node_count];
+}
+
+// Every offset must be in order and every kid must be a jnode, or kids() would read past the file.
+static bool kidSectionValid(TreeHeader const &header, char const *const map) {
+  if (header.section_bytes[KID_SECTION] == 0 || header.id_width != sizeof(jnid_t))
+    return true;
+  jnid_t const count = header.node_count;
+  uint64_t const *const offsets = (uint64_t const*)(map + header.section_offset(KID_SECTION));
+  jnid_t const *const kid_ids = (jnid_t const*)(offsets + count + 1);
+  bool valid = true;
+  #pragma omp parallel for reduction(&&:valid)
+  for (jnid_t id = 0; id < count; ++id) {
+    valid = valid && offsets[id] <= offsets[id + 1] && offsets[id + 1] <= offsets[count];
+    for (uint64_t i = offsets[id]; valid && i < offsets[id + 1]; ++i)
+      valid = kid_ids[i] < count;
+  }
+  return valid;
+}
+
+/* Trees are mapped privately, so the file never changes underneath other readers.
+ * A dense nodes section from a build with the same layout is used in place; anything else is expanded,
+ * with its ids and weights widened or narrowed to this build's. A tree that doesn't fit them is rejected.
+ * The kid section is used in place if its ids are this build's width, and rebuilt otherwise.
+ * Only the header and section sizes are checked by default, so an in-place tree is paged in as it is used;
+ * verify also checks the checksum and the kid section, which reads the whole file once.
+ * A headerless tree from before TreeHeader is read as this build's raw JNodes; util/upgrade_tree converts one. */
+JNodeTable::JNodeTable(char const *filename, bool const verify) :
+  nodes_state(State::LOADED), map_fd(-1), file_map(nullptr), file_bytes(0), end_id(0), max_id(0), nodes(nullptr),
+  kid_data(0), kid_offsets(nullptr), kid_ids(nullptr), pst_data(0), jxn_data(0), roots(0)
 {
-  int fd = open(filename, O_RDWR);
+  int fd = open(filename, O_RDONLY);
   if (fd == -1)
     throw std::bad_alloc();
 
   struct stat buf;
-  if (fstat(fd, &buf) == -1) {
+  if (fstat(fd, &buf) == -1 || (size_t) buf.st_size < sizeof(jnid_t)) {
     close(fd);
+    fprintf(stderr, "ERROR: %s is not a tree file.\n", filename);
     throw std::bad_alloc();
   }
-  max_id = (buf.st_size - sizeof(jnid_t)) / sizeof(JNode);
 
-  char *const nodes_map = (char*)mmap(nullptr, sizeof(jnid_t) + sizeof(JNode) * max_id,
-        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (nodes_map == MAP_FAILED) {
-    close(fd);
+  char *const map = (char*)mmap(nullptr, buf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
     throw std::bad_alloc();
+
+  auto fail = [&](char const *const error) {
+    if (nodes_state == State::ALLOCATED)
+      free(nodes);
+    munmap(map, buf.st_size);
+    fprintf(stderr, "ERROR: %s %s.\n", filename, error);
+    throw std::bad_alloc();
+  };
+
+  TreeHeader const expected;
+  TreeHeader const &header = *(TreeHeader const*)map;
+  if ((size_t) buf.st_size < sizeof(TreeHeader) || header.magic != TREE_MAGIC) {
+    // Before TreeHeader, a tree file was end_id followed by max_id raw JNodes.
+    size_t const legacy_nodes = (buf.st_size - sizeof(jnid_t)) / sizeof(JNode);
+    jnid_t const count = *(jnid_t const*)map;
+    if ((buf.st_size - sizeof(jnid_t)) % sizeof(JNode) != 0 || (size_t) count > legacy_nodes)
+      fail("is not a tree file");
+
+    end_id = max_id = count;
+    nodes = (JNode*)malloc(sizeof(JNode) * max_id);
+    if (nodes == nullptr && max_id != 0)
+      fail("could not be loaded");
+    nodes_state = State::ALLOCATED;
+    memcpy(nodes, map + sizeof(jnid_t), sizeof(JNode) * end_id);
+
+    for (jnid_t id = 0; id < end_id; ++id)
+      if (parent(id) != INVALID_JNID && (size_t) parent(id) >= (size_t) end_id)
+        fail("is corrupt");
+    munmap(map, buf.st_size);
+    makeKids();
+    return;
+  }
+
+  char const *error =
+    header.version != TREE_VERSION ? "has an unsupported version" :
+    (header.id_width != 4 && header.id_width != 8) || (header.weight_width != 4 && header.weight_width != 8) ?
+      "has unsupported id or weight widths" :
+    header.node_count > (uint64_t) std::numeric_limits<jnid_t>::max() ? "has more jnodes than vid_t can number" :
+    !header.fits(buf.st_size) ? "is truncated" :
+    !kidSectionFits(header, map) ? "is corrupt" :
+    verify && header.checksum != checksum(map + sizeof(TreeHeader), buf.st_size - sizeof(TreeHeader), 0) ?
+      "fails its checksum" :
+    verify && !kidSectionValid(header, map) ? "is corrupt" :
+    nullptr;
+  if (error != nullptr)
+    fail(error);
+
+  end_id = max_id = header.node_count;
+  char const *const node_section = map + header.section_offset(NODE_SECTION);
+  uint64_t const node_bytes = header.section_bytes[NODE_SECTION];
+  bool const has_pre = (header.fields & TREE_PRE_WEIGHT) != 0;
+  bool const same_layout = header.id_width == expected.id_width && header.weight_width == expected.weight_width &&
+    has_pre == ((expected.fields & TREE_PRE_WEIGHT) != 0);
+
+  // A dense JNode is parent, pst_weight, then maybe pre_weight, each aligned to its width.
+  uint32_t const align = std::max(header.id_width, header.weight_width);
+  uint32_t const pst_offset = align;
+  uint32_t const pre_offset = pst_offset + header.weight_width;
+  uint64_t const stride = (pre_offset + (has_pre ? header.weight_width : 0) + align - 1) / align * align;
+  if (!(header.fields & TREE_SPARSE) && node_bytes != stride * header.node_count)
+    fail("is corrupt");
+
+  if (!(header.fields & TREE_SPARSE) && same_layout) {
+    nodes = (JNode*)(map + sizeof(TreeHeader));
+  }
+  else {
+    nodes = (JNode*)malloc(sizeof(JNode) * max_id);
+    if (nodes == nullptr && max_id != 0)
+      fail("could not be loaded");
+    nodes_state = State::ALLOCATED;
+
+    #pragma omp parallel for
+    for (jnid_t id = 0; id < end_id; ++id)
+      new(&nodes[id]) JNode();
+
+    auto visit = [this](jnid_t const id, jnid_t const par, esize_t const pst, esize_t const pre) {
+      parent(id) = par;
+      pst_weight(id) = pst;
+      pre_weight(id) = pre;
+    };
+    if (header.fields & TREE_SPARSE) {
+      if (!decode(0, end_id, node_section, node_section + node_bytes, visit, has_pre))
+        fail("is corrupt or has weights past esize_t's limit");
+    }
+    else {
+      uint64_t const invalid = header.id_width == sizeof(uint32_t) ? UINT32_MAX : UINT64_MAX;
+      uint64_t const max_weight = std::numeric_limits<esize_t>::max();
+      bool valid = true;
+      #pragma omp parallel for reduction(&&:valid)
+      for (jnid_t id = 0; id < end_id; ++id) {
+        char const *const record = node_section + stride * id;
+        uint64_t const par = get_width(record, header.id_width);
+        uint64_t const pst = get_width(record + pst_offset, header.weight_width);
+        uint64_t const pre = has_pre ? get_width(record + pre_offset, header.weight_width) : 0;
+        if ((par != invalid && par >= (uint64_t) end_id) || pst > max_weight || pre > max_weight)
+          valid = false;
+        else
+          visit(id, par == invalid ? INVALID_JNID : (jnid_t) par, (esize_t) pst, (esize_t) pre);
+      }
+      if (!valid)
+        fail("is corrupt or has weights past esize_t's limit");
+    }
   }
-  close(fd);
-  end_id = *((jnid_t*)nodes_map);
-  nodes = (JNode*)(nodes_map + sizeof(jnid_t));
 
-  makeKids();
+  if (header.section_bytes[PST_SECTION] != 0 && !readSection(map + header.section_offset(PST_SECTION),
+        header.section_bytes[PST_SECTION], end_id, header.id_width, pst_data))
+    fail("is corrupt or has pst ids past vid_t's limit");
+  if (header.section_bytes[JXN_SECTION] != 0 && !readSection(map + header.section_offset(JXN_SECTION),
+        header.section_bytes[JXN_SECTION], end_id, header.id_width, jxn_data))
+    fail("is corrupt or has jxn ids past vid_t's limit");
+
+  bool const kids_in_place = header.section_bytes[KID_SECTION] != 0 && header.id_width == sizeof(jnid_t);
+  if (kids_in_place) {
+    kid_offsets = (uint64_t const*)(map + header.section_offset(KID_SECTION));
+    kid_ids = (jnid_t*)(kid_offsets + end_id + 1);
+  }
+  else {
+    makeKids();
+  }
+
+  if (nodes_state == State::LOADED || kids_in_place) {
+    file_map = map;
+    file_bytes = buf.st_size;
+  }
+  else {
+    munmap(map, buf.st_size);
+  }
 }
 
 JNodeTable::JNodeTable(JNode *n, jnid_t end) :
-  nodes_state(State::TEMPORARY), end_id(end), max_id(end_id), nodes(n),
-  kid_data(0), pst_data(0), jxn_data(0), roots(0)
+  nodes_state(State::TEMPORARY), map_fd(-1), file_map(nullptr), file_bytes(0),
+  end_id(end), max_id(end_id), nodes(n),
+  kid_data(0), kid_offsets(nullptr), kid_ids(nullptr), pst_data(0), jxn_data(0), roots(0)
 {
   if (nodes != nullptr)
     makeKids();
 }
 
 JNodeTable::JNodeTable(JNodeTable &&other) :
-  nodes_state(other.nodes_state), end_id(other.end_id), max_id(other.max_id), nodes(other.nodes),
-  kid_data(std::move(other.kid_data)), pst_data(std::move(other.pst_data)), jxn_data(std::move(other.jxn_data)),
+  nodes_state(other.nodes_state), map_fd(other.map_fd), file_map(other.file_map), file_bytes(other.file_bytes),
+  end_id(other.end_id), max_id(other.max_id), nodes(other.nodes),
+  kid_data(std::move(other.kid_data)), kid_offsets(other.kid_offsets), kid_ids(other.kid_ids),
+  kid_offset_data(std::move(other.kid_offset_data)), kid_id_data(std::move(other.kid_id_data)),
+  pst_data(std::move(other.pst_data)), jxn_data(std::move(other.jxn_data)),
   roots(std::move(other.roots))
 {
   other.nodes_state = State::TEMPORARY;
+  other.map_fd = -1;
+  other.file_map = nullptr;
+  other.kid_offsets = nullptr;
+  other.kid_ids = nullptr;
   other.end_id = 0;
   other.max_id = 0;
   other.nodes = nullptr;
 }
 
 JNodeTable::JNodeTable(JNodeTable const &other) :
-  nodes_state(State::ALLOCATED), end_id(other.end_id),
+  nodes_state(State::ALLOCATED), map_fd(-1), file_map(nullptr), file_bytes(0), end_id(other.end_id),
   max_id(other.max_id), nodes((JNode*)malloc(sizeof(JNode) * max_id)),
-  kid_data(other.kid_data), pst_data(other.pst_data), jxn_data(other.jxn_data), roots(other.roots)
+  kid_data(other.kid_data), kid_offsets(nullptr), kid_ids(nullptr),
+  pst_data(other.pst_data), jxn_data(other.jxn_data), roots(other.roots)
 {
   if (nodes == nullptr)
     throw std::bad_alloc();
-  std::memcpy(nodes, other.nodes, end_id);
+  std::memcpy(nodes, other.nodes, sizeof(JNode) * end_id);
+
+  // The other table's kids may live in its file, which we don't share.
+  if (other.kid_offsets != nullptr)
+    makeKids();
 }
 
 JNodeTable::JNodeTable(JNodeTable const &other, jnid_t partial_end) :
-  nodes_state(State::ALLOCATED), end_id(other.end_id),
+  nodes_state(State::ALLOCATED), map_fd(-1), file_map(nullptr), file_bytes(0), end_id(other.end_id),
   max_id(other.max_id), nodes((JNode*)malloc(sizeof(JNode) * max_id)),
-  kid_data(other.kid_data, partial_end),
+  kid_data(other.kid_data, partial_end), kid_offsets(nullptr), kid_ids(nullptr),
   pst_data(other.pst_data, partial_end),
   jxn_data(other.jxn_data, partial_end),
   roots(max_id)
@@ -150,21 +582,95 @@ JNodeTable::JNodeTable(JNodeTable const &other, jnid_t partial_end) :
   }
 }
 
+/* A mapped tree is finished in place: its header is filled in, the file is cut down to end_id nodes,
+ * and the tables are appended. A loaded tree just lets go of its file. */
 JNodeTable::~JNodeTable() {
+  if (file_map != nullptr)
+    munmap(file_map, file_bytes);
+
   if (nodes_state == State::ALLOCATED)
     free(nodes);
   else if (nodes_state == State::MAPPED) {
-    char *const nodes_map = ((char*)nodes) - sizeof(jnid_t);
-    *((jnid_t*)nodes_map) = end_id;
-    munmap(nodes_map, sizeof(jnid_t) + sizeof(JNode*) * max_id);
+    char *const map = ((char*)nodes) - sizeof(TreeHeader);
+    TreeHeader header;
+    header.node_count = end_id;
+    header.section_bytes[NODE_SECTION] = sizeof(JNode) * end_id;
+    uint64_t offset = header.file_bytes();
+    memset((char*)nodes + sizeof(JNode) * end_id, 0, offset - sizeof(TreeHeader) - sizeof(JNode) * end_id);
+    header.checksum = checksum((char*)nodes, offset - sizeof(TreeHeader), 0);
+
+    bool success = ftruncate(map_fd, offset) == 0;
+    writeTables(header, [this,&offset,&success](char const *const data, size_t const len) {
+      uint64_t const zero = 0;
+      success &= pwrite(map_fd, data, len, offset) == (ssize_t) len;
+      success &= pwrite(map_fd, &zero, TreeHeader::padded(len) - len, offset + len) ==
+        (ssize_t) (TreeHeader::padded(len) - len);
+      offset += TreeHeader::padded(len);
+    });
+    munmap(map, sizeof(TreeHeader) + TreeHeader::padded(sizeof(JNode) * max_id));
+    success &= pwrite(map_fd, &header, sizeof(TreeHeader), 0) == sizeof(TreeHeader);
+    if (!success)
+      fprintf(stderr, "ERROR: could not finish a mapped tree.\n");
+    close(map_fd);
+  }
+}
+
+/* Appends the kid section, then a CSR section for every pst or jxn table that covers the whole tree.
+ * write(data, len) must put data at the end of the file, followed by its padding. */
+template <typename Writer>
+void JNodeTable::writeTables(TreeHeader &header, Writer write) const
+{
+  uint64_t words = (header.file_bytes() - sizeof(TreeHeader)) / 8;
+  auto write_section = [&header,&words,&write](int const section, std::vector<char> const &bytes) {
+    write(bytes.data(), bytes.size());
+    header.section_bytes[section] = bytes.size();
+    header.checksum += checksum(bytes.data(), bytes.size(), words);
+    words += TreeHeader::padded(bytes.size()) / 8;
+  };
+
+  std::vector<char> bytes;
+  if (end_id != 0) {
+    kidSection(*this, end_id, bytes);
+    write_section(KID_SECTION, bytes);
   }
+  if (csrSection(pst_data, end_id, bytes))
+    write_section(PST_SECTION, bytes);
+  if (csrSection(jxn_data, end_id, bytes))
+    write_section(JXN_SECTION, bytes);
 }
 
 
+/* Writes whichever of the sparse and dense node encodings is smaller, then any complete tables. */
 void JNodeTable::save(char const *const filename) {
   std::ofstream stream(filename, std::ios::binary | std::ios::trunc);
-  stream.write((char*)&end_id, sizeof(jnid_t));
-  stream.write((char*)nodes, sizeof(JNode) * max_id);
+  auto write = [&stream](char const *const data, size_t const len) {
+    uint64_t const zero = 0;
+    stream.write(data, len);
+    stream.write((char*)&zero, TreeHeader::padded(len) - len);
+  };
+
+  TreeHeader header;
+  header.node_count = end_id;
+  stream.write((char*)&header, sizeof(TreeHeader));
+
+  std::vector<char> buf;
+  if (encode(0, end_id, buf, sizeof(JNode) * end_id)) {
+    header.fields |= TREE_SPARSE;
+    write(buf.data(), buf.size());
+    header.section_bytes[NODE_SECTION] = buf.size();
+    header.checksum = checksum(buf.data(), buf.size(), 0);
+  }
+  else {
+    write((char*)nodes, sizeof(JNode) * end_id);
+    header.section_bytes[NODE_SECTION] = sizeof(JNode) * end_id;
+    header.checksum = checksum((char*)nodes, sizeof(JNode) * end_id, 0);
+  }
+  std::vector<char>().swap(buf);
+
+  writeTables(header, write);
+
+  stream.seekp(0);
+  stream.write((char*)&header, sizeof(TreeHeader));
 }
 
 
@@ -200,55 +706,444 @@ void JNodeTable::merge(JNodeTable const &lhs, JNodeTable const &rhs, bool const
   }
 }
 
+/* The merged tree is unique: parent(X) is the least Y > X that X reaches through edges no greater than Y.
+ * So split the jnids into one contiguous range per thread and merge each range as if it were alone,
+ * deferring any kid that lies below the range. Then walk the ranges in order and zip each deferred
+ * edge into the tree; everything below the current range is final by then, so the result is identical. */
+void JNodeTable::parallel_merge(JNodeTable const &lhs, JNodeTable const &rhs, bool const make_kids)
+{
+  assert(lhs.size() == rhs.size());
+  assert(size() == 0 && lhs.size() <= max_id);
+
+  //XXX pre_weight is charged to the root found *during* the merge, which the fix-up pass can't replay.
+  #ifdef USE_PRE_WEIGHT
+  if (make_kids) {
+    merge(lhs, rhs, make_kids);
+    return;
+  }
+  #endif
+
+  jnid_t const num_jnids = lhs.size();
+  int const num_ranges = std::min<size_t>(omp_get_max_threads(), num_jnids / (64 * KILO) + 1);
+  if (num_ranges == 1) {
+    merge(lhs, rhs, make_kids);
+    return;
+  }
+
+  struct Edge { jnid_t kid; jnid_t id; };
+  std::vector< std::vector<Edge> > deferred(num_ranges);
+
+  #pragma omp parallel num_threads(num_ranges)
+  {
+    int const range = omp_get_thread_num();
+    jnid_t const range_beg = (size_t) num_jnids * range / num_ranges;
+    jnid_t const range_end = (size_t) num_jnids * (range + 1) / num_ranges;
+
+    for (jnid_t current = range_beg; current != range_end; ++current) {
+      new(&nodes[current]) JNode();
+
+      auto insert_kids = [current,range_beg,range,&deferred,this](JNodeTable const &src)
+      {
+        for (jnid_t const kid : src.kids(current)) {
+          if (kid < range_beg)
+            deferred[range].push_back({kid, current});
+          else
+            adopt(kid, current);
+        }
+        pst_weight(current) += src.pst_weight(current);
+      };
+      insert_kids(lhs);
+      insert_kids(rhs);
+    }
+  }
+  end_id = num_jnids;
+
+  std::vector<jnid_t> jump(num_jnids);
+  #pragma omp parallel for
+  for (jnid_t id = 0; id < num_jnids; ++id)
+    jump[id] = parent(id);
+
+  for (int range = 1; range != num_ranges; ++range)
+    for (Edge const &edge : deferred[range])
+      zip(edge.kid, edge.id, jump);
+
+  if (make_kids)
+    makeKids();
+}
+
+/* Zip every edge of a finished tree of the same size into this one, in place. */
+void JNodeTable::zipMerge(JNodeTable const &other)
+{
+  assert(size() == other.size());
+  std::vector<jnid_t> jump;
+  zipNodes(other.nodes, jump);
+}
+
+void JNodeTable::zipNodes(JNode const *src, std::vector<jnid_t> &jump)
+{
+  initJump(jump);
+  for (jnid_t id = 0; id != end_id; ++id) {
+    //XXX Zipping drops pre_weight; see mpi_merge.
+    pst_weight(id) += src[id].pst_weight;
+    if (src[id].parent != INVALID_JNID)
+      zip(id, src[id].parent, jump);
+  }
+}
+
 template <bool make_kids>
 void mpi_merge_reduction(void *in, void *inout, int *len, MPI_Datatype *datatype) {
   JNodeTable lhs((JNodeTable::JNode*)in, *len);
   JNodeTable rhs((JNodeTable::JNode*)inout, *len);
 
   JNodeTable tmp(*len, make_kids, 0);
-  tmp.merge(lhs, rhs, make_kids);
+  tmp.parallel_merge(lhs, rhs, make_kids);
   memcpy(inout, tmp.nodes, sizeof(JNodeTable::JNode) * tmp.end_id);
 }
 
+/* The reduction is two-level: ranks first merge within their node through shared memory,
+ * then one leader per node streams the result across the network. */
 void JNodeTable::mpi_merge(bool const make_kids)
 {
-  MPI_Datatype MPI_jnid_t = sizeof(jnid_t) == 4 ? MPI_UINT32_T : MPI_UINT64_T;
-  MPI_Datatype MPI_esize_t = sizeof(esize_t) == 4 ? MPI_UINT32_T : MPI_UINT64_T;
-#ifndef USE_PRE_WEIGHT
-  int count = 2;
-  int blocklengths[2] = { 1, 1 };
-  MPI_Aint offsets[2] = { offsetof(JNode, parent), offsetof(JNode, pst_weight) };
-  MPI_Datatype types[2] = { MPI_jnid_t, MPI_esize_t };
-#else
-  int count = 3;
-  int blocklengths[3] = { 1, 1, 1 };
-  MPI_Aint offsets[3] = { offsetof(JNode, parent), offsetof(JNode, pst_weight), offsetof(JNode, pre_weight) };
-  MPI_Datatype types[3] = { MPI_jnid_t, MPI_esize_t, MPI_esize_t };
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+#ifdef USE_PRE_WEIGHT
+  //XXX pre_weight is charged to the root found *during* a merge, which zipping can't replay.
+  if (make_kids) {
+    MPI_Datatype MPI_jnid_t = sizeof(jnid_t) == 4 ? MPI_UINT32_T : MPI_UINT64_T;
+    MPI_Datatype MPI_esize_t = sizeof(esize_t) == 4 ? MPI_UINT32_T : MPI_UINT64_T;
+    int count = 3;
+    int blocklengths[3] = { 1, 1, 1 };
+    MPI_Aint offsets[3] = { offsetof(JNode, parent), offsetof(JNode, pst_weight), offsetof(JNode, pre_weight) };
+    MPI_Datatype types[3] = { MPI_jnid_t, MPI_esize_t, MPI_esize_t };
+    MPI_Datatype mpi_struct_type, mpi_jnode_type;
+    MPI_Type_create_struct(count, blocklengths, offsets, types, &mpi_struct_type);
+    MPI_Type_create_resized(mpi_struct_type, 0, sizeof(JNode), &mpi_jnode_type);
+    MPI_Type_commit(&mpi_jnode_type);
+    MPI_Type_free(&mpi_struct_type);
+
+    JNode *outbuf = rank != 0 ? nullptr : (JNode*)malloc(sizeof(JNode) * max_id);
+
+    MPI_Op reduce_op;
+    MPI_Op_create(mpi_merge_reduction<true>, 0, &reduce_op);
+    MPI_Reduce(nodes, outbuf, end_id, mpi_jnode_type, reduce_op, 0, MPI_COMM_WORLD);
+    MPI_Op_free(&reduce_op);
+    MPI_Type_free(&mpi_jnode_type);
+
+    if (rank == 0) {
+      if (nodes_state == State::ALLOCATED)
+        std::swap(nodes, outbuf);
+      else
+        memcpy(nodes, outbuf, sizeof(JNode) * end_id);
+      free(outbuf);
+    }
+    return;
+  }
 #endif
-  MPI_Datatype mpi_jnode_type;
-  MPI_Type_create_struct(count, blocklengths, offsets, types, &mpi_jnode_type);
-  MPI_Type_commit(&mpi_jnode_type);
 
+  // Ranks that share a node merge through shared memory, so only one leader per node crosses the network.
+  MPI_Comm node_comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+  int node_rank;
+  MPI_Comm_rank(node_comm, &node_rank);
+
+  std::vector<jnid_t> jump;
+  mpi_node_merge(node_comm, jump);
+  MPI_Comm_free(&node_comm);
+
+  MPI_Comm leader_comm;
+  MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+  if (leader_comm != MPI_COMM_NULL) {
+    mpi_stream_merge(leader_comm, jump);
+    MPI_Comm_free(&leader_comm);
+  }
+
+  if (rank == 0 && make_kids)
+    makeKids();
+}
+
+/* Ranks on one node reduce along a binomial tree without messages: a sender copies its nodes
+ * into its segment of a shared window once, and its receiver zips them straight out of that segment. */
+void JNodeTable::mpi_node_merge(MPI_Comm const comm, std::vector<jnid_t> &jump)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  int size;
+  MPI_Comm_size(comm, &size);
+  if (size == 1)
+    return;
+
+  // Only the leader never sends, so it needs no segment.
+  MPI_Info info;
+  MPI_Info_create(&info);
+  MPI_Info_set(info, "alloc_shared_noncontig", "true");
+  JNode *segment;
+  MPI_Win win;
+  MPI_Win_allocate_shared(rank == 0 ? 0 : sizeof(JNode) * end_id, sizeof(JNode),
+      info, comm, &segment, &win);
+  MPI_Info_free(&info);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+  for (int step = 1; step < size; step <<= 1) {
+    bool const sends = (rank & (2 * step - 1)) == step;
+    bool const recvs = (rank & (2 * step - 1)) == 0 && rank + step < size;
+
+    if (sends) {
+      memcpy(segment, nodes, sizeof(JNode) * end_id);
+      MPI_Win_sync(win);
+    }
+    MPI_Barrier(comm);
+
+    if (recvs) {
+      MPI_Aint seg_size;
+      int disp_unit;
+      JNode *kid_segment;
+      MPI_Win_shared_query(win, rank + step, &seg_size, &disp_unit, &kid_segment);
+      assert(seg_size >= (MPI_Aint) (sizeof(JNode) * end_id));
+      MPI_Win_sync(win);
+
+      zipNodes(kid_segment, jump);
+    }
+  }
+
+  // Nobody may free a segment its receiver is still reading.
+  MPI_Barrier(comm);
+  MPI_Win_unlock_all(win);
+  MPI_Win_free(&win);
+}
+
+/* Ranks reduce along a binomial tree, streaming their nodes in encoded chunks of increasing jnid.
+ * Zipping an edge never touches a jnid below its kid, so once every child has sent chunk c
+ * the same chunk of our own nodes is final and can be forwarded while later chunks are still in flight. */
+void JNodeTable::mpi_stream_merge(MPI_Comm const comm, std::vector<jnid_t> &jump)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  int size;
+  MPI_Comm_size(comm, &size);
+
+  int parent_rank = -1;
+  std::vector<int> kid_ranks;
+  for (int step = 1; step < size; step <<= 1) {
+    if (rank & step) {
+      parent_rank = rank - step;
+      break;
+    }
+    if (rank + step < size)
+      kid_ranks.push_back(rank + step);
+  }
+
+  jnid_t const chunk_size = 64 * KILO;
+  size_t const num_chunks = (end_id + chunk_size - 1) / chunk_size;
+  auto chunk_end = [this,chunk_size](size_t const c) {
+    return (jnid_t) std::min<size_t>((c + 1) * chunk_size, end_id);
+  };
+
+  // An encoded record is at most one maximal varint per field.
+  size_t const varint_bytes = (8 * sizeof(uint64_t) + 6) / 7;
+  #ifdef USE_PRE_WEIGHT
+  size_t const max_chunk_bytes = chunk_size * 4 * varint_bytes;
+  #else
+  size_t const max_chunk_bytes = chunk_size * 3 * varint_bytes;
+  #endif
+
+  // Two buffers per kid, so the next chunk lands while this one is zipped.
+  std::vector< std::vector<char> > recv_bufs(kid_ranks.size() * 2, std::vector<char>(max_chunk_bytes));
+  std::vector<MPI_Request> recvs(kid_ranks.size() * 2, MPI_REQUEST_NULL);
+  std::vector< std::vector<char> > send_bufs(2);
+  MPI_Request sends[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+
+  auto post_recv = [&](size_t const k, size_t const c) {
+    size_t const slot = 2 * k + c % 2;
+    MPI_Irecv(recv_bufs[slot].data(), max_chunk_bytes, MPI_BYTE,
+        kid_ranks[k], 0, comm, &recvs[slot]);
+  };
+
+  if (!kid_ranks.empty()) {
+    initJump(jump);
+    if (num_chunks != 0)
+      for (size_t k = 0; k != kid_ranks.size(); ++k)
+        post_recv(k, 0);
+  }
+
+  for (size_t c = 0; c != num_chunks; ++c) {
+    for (size_t k = 0; k != kid_ranks.size(); ++k) {
+      size_t const slot = 2 * k + c % 2;
+      MPI_Status status;
+      MPI_Wait(&recvs[slot], &status);
+      int len;
+      MPI_Get_count(&status, MPI_BYTE, &len);
+
+      // The slot is busy until zipped, so the next chunk goes in the other one.
+      if (c + 1 != num_chunks)
+        post_recv(k, c + 1);
+      zipEncoded(c * chunk_size, recv_bufs[slot].data(), recv_bufs[slot].data() + len, jump);
+    }
+
+    if (parent_rank != -1) {
+      MPI_Wait(&sends[c % 2], MPI_STATUS_IGNORE);
+      send_bufs[c % 2].clear();
+      encode(c * chunk_size, chunk_end(c), send_bufs[c % 2]);
+      MPI_Isend(send_bufs[c % 2].data(), send_bufs[c % 2].size(), MPI_BYTE,
+          parent_rank, 0, comm, &sends[c % 2]);
+    }
+  }
+  MPI_Waitall(2, sends, MPI_STATUSES_IGNORE);
+}
+
+
+/* The completion-order reduction keeps two counters in a window on rank 0: the rank waiting for a partner
+ * (or -1) and the number of trees left. The window is collective, so it must be made before the map. */
+#define ASYNC_WAITING 0
+#define ASYNC_LEFT 1
+#define ASYNC_TREE_TAG 1
+#define ASYNC_FINAL_TAG 2
+
+MPI_Win JNodeTable::mpi_async_window()
+{
   int rank;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  JNode *outbuf = rank != 0 ? nullptr : (JNode*)malloc(sizeof(JNode) * max_id);
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-  MPI_Op reduce_op;
-  if (make_kids)
-    MPI_Op_create(mpi_merge_reduction<true>, 0, &reduce_op);
-  else
-    MPI_Op_create(mpi_merge_reduction<false>, 0, &reduce_op);
-  MPI_Reduce(nodes, outbuf, end_id, mpi_jnode_type, reduce_op, 0, MPI_COMM_WORLD);
-  
+  long *counters;
+  MPI_Win win;
+  MPI_Win_allocate(2 * sizeof(long), sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD, &counters, &win);
   if (rank == 0) {
-    if (nodes_state == State::ALLOCATED)
-      std::swap(nodes, outbuf);
-    else
-      memcpy(nodes, outbuf, sizeof(JNode) * end_id);
-    free(outbuf);
+    counters[ASYNC_WAITING] = -1;
+    counters[ASYNC_LEFT] = size;
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  MPI_Win_lock_all(0, win);
+  return win;
+}
+
+/* Each rank offers its tree as soon as it is done with it. If nobody is waiting it waits,
+ * otherwise it sends its tree to the waiting rank and is finished; the receiver merges and offers again.
+ * So the first pair to finish merges first, and a straggling map only delays the merges that need it.
+ * Whoever makes the last merge hands the result to rank 0. */
+void JNodeTable::mpi_async_merge(MPI_Win win, bool const make_kids)
+{
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+#ifdef USE_PRE_WEIGHT
+  //XXX pre_weight is charged to the root found *during* a merge, which zipping can't replay.
+  if (make_kids) {
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+    mpi_merge(make_kids);
+    return;
   }
+#endif
+
+  long const none = -1;
+  long const self = rank;
+  long const minus_one = -1;
+
+  std::vector<jnid_t> jump;
+  bool has_final = size == 1;
+  while (!has_final) {
+    // Either become the waiting rank or claim the one already waiting.
+    long partner;
+    for (;;) {
+      MPI_Compare_and_swap(&self, &none, &partner, MPI_LONG, 0, ASYNC_WAITING, win);
+      MPI_Win_flush(0, win);
+      if (partner == -1)
+        break;
+
+      long claimed;
+      MPI_Compare_and_swap(&none, &partner, &claimed, MPI_LONG, 0, ASYNC_WAITING, win);
+      MPI_Win_flush(0, win);
+      if (claimed == partner)
+        break;
+    }
+
+    if (partner != -1) {
+      mpi_send_encoded(partner, ASYNC_TREE_TAG, MPI_COMM_WORLD);
+      break;
+    }
+
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, ASYNC_TREE_TAG, MPI_COMM_WORLD, &status);
+    mpi_recv_encoded(status.MPI_SOURCE, ASYNC_TREE_TAG, MPI_COMM_WORLD, jump);
+
+    long left;
+    MPI_Fetch_and_op(&minus_one, &left, MPI_LONG, 0, ASYNC_LEFT, MPI_SUM, win);
+    MPI_Win_flush(0, win);
+    has_final = left == 2;
+  }
+
+  if (has_final && rank != 0)
+    mpi_send_encoded(0, ASYNC_FINAL_TAG, MPI_COMM_WORLD);
+  else if (!has_final && rank == 0) {
+    // Our own partial went out long ago; start over from an empty tree.
+    #pragma omp parallel for
+    for (jnid_t id = 0; id < end_id; ++id)
+      new(&nodes[id]) JNode();
+    jump.clear();
+
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, ASYNC_FINAL_TAG, MPI_COMM_WORLD, &status);
+    mpi_recv_encoded(status.MPI_SOURCE, ASYNC_FINAL_TAG, MPI_COMM_WORLD, jump);
+  }
+
+  MPI_Win_unlock_all(win);
+  MPI_Win_free(&win);
+
+  if (rank == 0 && make_kids)
+    makeKids();
+}
+
+/* Point-to-point versions of the chunked stream in mpi_stream_merge. */
+void JNodeTable::mpi_send_encoded(int const dest, int const tag, MPI_Comm const comm) const
+{
+  jnid_t const chunk_size = 64 * KILO;
+  std::vector< std::vector<char> > send_bufs(2);
+  MPI_Request sends[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+
+  for (size_t c = 0; c * chunk_size < end_id; ++c) {
+    MPI_Wait(&sends[c % 2], MPI_STATUS_IGNORE);
+    send_bufs[c % 2].clear();
+    encode(c * chunk_size, std::min<size_t>((c + 1) * chunk_size, end_id), send_bufs[c % 2]);
+    MPI_Isend(send_bufs[c % 2].data(), send_bufs[c % 2].size(), MPI_BYTE, dest, tag, comm, &sends[c % 2]);
+  }
+  MPI_Waitall(2, sends, MPI_STATUSES_IGNORE);
 }
 
+void JNodeTable::mpi_recv_encoded(int const src, int const tag, MPI_Comm const comm, std::vector<jnid_t> &jump)
+{
+  jnid_t const chunk_size = 64 * KILO;
+  size_t const num_chunks = (end_id + chunk_size - 1) / chunk_size;
+
+  size_t const varint_bytes = (8 * sizeof(uint64_t) + 6) / 7;
+  #ifdef USE_PRE_WEIGHT
+  size_t const max_chunk_bytes = chunk_size * 4 * varint_bytes;
+  #else
+  size_t const max_chunk_bytes = chunk_size * 3 * varint_bytes;
+  #endif
+
+  std::vector< std::vector<char> > recv_bufs(2, std::vector<char>(max_chunk_bytes));
+  MPI_Request recvs[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+  if (num_chunks != 0)
+    MPI_Irecv(recv_bufs[0].data(), max_chunk_bytes, MPI_BYTE, src, tag, comm, &recvs[0]);
+
+  initJump(jump);
+  for (size_t c = 0; c != num_chunks; ++c) {
+    MPI_Status status;
+    MPI_Wait(&recvs[c % 2], &status);
+    int len;
+    MPI_Get_count(&status, MPI_BYTE, &len);
+
+    if (c + 1 != num_chunks)
+      MPI_Irecv(recv_bufs[(c + 1) % 2].data(), max_chunk_bytes, MPI_BYTE, src, tag, comm, &recvs[(c + 1) % 2]);
+    zipEncoded(c * chunk_size, recv_bufs[c % 2].data(), recv_bufs[c % 2].data() + len, jump);
+  }
+}
 
 /* 
  * FAQ
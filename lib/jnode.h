@@ -48,10 +48,15 @@ typedef SimpleUnionFind<jnid_t> UnionFind;
 typedef FastUnionFind<jnid_t> UnionFind;
 #endif
 
+struct TreeHeader;
+
 class JNodeTable {
 private:
-  enum class State { ALLOCATED, MAPPED, TEMPORARY };
+  enum class State { ALLOCATED, MAPPED, LOADED, TEMPORARY };
   State nodes_state;
+  int map_fd;
+  char *file_map;
+  size_t file_bytes;
 
   struct JNode {
     jnid_t parent;
@@ -72,6 +77,12 @@ private:
   JNode *nodes;
 
   JDataTable<jnid_t> kid_data;
+  // Finished kids are kept as CSR, either in the tree file or in the two vectors below.
+  // When kid_offsets is set, kid_data is unused.
+  uint64_t const *kid_offsets;
+  jnid_t *kid_ids;
+  std::vector<uint64_t> kid_offset_data;
+  std::vector<jnid_t> kid_id_data;
   JDataTable<vid_t>  pst_data;
   JDataTable<vid_t>  jxn_data;
   
@@ -83,7 +94,7 @@ public:
   JNodeTable() = delete;
   JNodeTable(jnid_t max_jnids, bool init_kids, size_t memory_limit);
   JNodeTable(char const *filename, jnid_t max_jnids, bool init_kids, size_t memory_limit);
-  JNodeTable(char const *filename);
+  JNodeTable(char const *filename, bool verify = false);
   JNodeTable(JNode *n, jnid_t end);
 
   JNodeTable(JNodeTable &&other);
@@ -97,13 +108,32 @@ public:
 
   void save(char const *filename);
   void merge(JNodeTable const &lhs, JNodeTable const &rhs, bool make_kids = false);
+  void parallel_merge(JNodeTable const &lhs, JNodeTable const &rhs, bool make_kids = false);
+  void zipMerge(JNodeTable const &other);
   void mpi_merge(bool make_kids = false);
+  static MPI_Win mpi_async_window();
+  void mpi_async_merge(MPI_Win win, bool make_kids = false);
+private:
+  template <typename Writer>
+  void writeTables(TreeHeader &header, Writer write) const;
+  void zipNodes(JNode const *src, std::vector<jnid_t> &jump);
+  void mpi_node_merge(MPI_Comm comm, std::vector<jnid_t> &jump);
+  void mpi_stream_merge(MPI_Comm comm, std::vector<jnid_t> &jump);
+  void mpi_send_encoded(int dest, int tag, MPI_Comm comm) const;
+  void mpi_recv_encoded(int src, int tag, MPI_Comm comm, std::vector<jnid_t> &jump);
+public:
   template <bool make_kids>
   friend void mpi_merge_reduction(void *in, void *inout, int *len, MPI_Datatype *datatype);
 
 
   inline jnid_t size() const { return end_id; }
 
+  /* SPARSE ENCODING
+   * Partial trees leave most jnodes untouched, so they are shipped and saved as a varint stream
+   * of (gap, parent - id, pst_weight) records for the touched jnodes only. */
+  bool encode(jnid_t beg, jnid_t end, std::vector<char> &buf, size_t max_len = (size_t)-1) const;
+  void zipEncoded(jnid_t beg, char const *itr, char const *end, std::vector<jnid_t> &jump);
+
   inline jnid_t newJNode() {
     assert(0 <= end_id && end_id < max_id);
     new(&nodes[end_id]) JNode();
@@ -160,6 +190,50 @@ public:
     if (kid != id)
       parent(kid) = id;
   }
+
+  /* Zipping inserts an edge into a finished tree, in any order, without the union-find.
+   * jump[X] must be an ancestor of X or INVALID_JNID; ancestors survive every zip, so it never goes stale. */
+  inline jnid_t climb(jnid_t const X, jnid_t const limit, std::vector<jnid_t> &jump) {
+    auto next = [&jump,limit,this](jnid_t const id) {
+      return jump[id] < limit ? jump[id] : parent(id);
+    };
+
+    // Find the topmost ancestor of X whose parent is not below limit.
+    jnid_t top = X;
+    while (parent(top) < limit)
+      top = next(top);
+    for (jnid_t id = X; id != top;) {
+      jnid_t const tmp = next(id);
+      jump[id] = top;
+      id = tmp;
+    }
+    return top;
+  }
+
+  inline void initJump(std::vector<jnid_t> &jump) const {
+    if (jump.size() == end_id)
+      return;
+    jump.resize(end_id);
+    #pragma omp parallel for
+    for (jnid_t id = 0; id < end_id; ++id)
+      jump[id] = parent(id);
+  }
+
+  inline void zip(jnid_t kid, jnid_t id, std::vector<jnid_t> &jump) {
+    assert(kid < id);
+    for (;;) {
+      jnid_t const top = climb(kid, id, jump);
+      jnid_t const old_parent = parent(top);
+      if (old_parent == id)
+        return;
+      parent(top) = id;
+      if (old_parent == INVALID_JNID)
+        return;
+      // top used to hang from old_parent, so id must now reach old_parent too.
+      kid = id;
+      id = old_parent;
+    }
+  }
   
 
   /* JDATA TABLE WRAPPERS */
@@ -168,8 +242,25 @@ public:
     assert(tmp == id);
   }
 
-  inline JData<jnid_t>& kids(jnid_t id) { return kid_data[id]; }
-  inline JData<jnid_t> const & kids(jnid_t id) const { return kid_data[id]; }
+  struct KidRange {
+    jnid_t *beg;
+    jnid_t *fin;
+
+    inline jnid_t* begin() const { return beg; }
+    inline jnid_t* end() const { return fin; }
+    inline jnid_t const * cbegin() const { return beg; }
+    inline jnid_t const * cend() const { return fin; }
+    inline size_t size() const { return fin - beg; }
+  };
+
+  inline KidRange kids(jnid_t id) const {
+    if (kid_offsets != nullptr)
+      return KidRange{kid_ids + kid_offsets[id], kid_ids + kid_offsets[id + 1]};
+    JData<jnid_t> const &data = kid_data[id];
+    return KidRange{data.begin(), data.end()};
+  }
+
+  inline void addKid(jnid_t id, jnid_t kid) { kid_data[id].push_back(kid); }
 
   inline void meetKid(jnid_t kid, jnid_t const id, size_t weight) {
     kid = roots.find(kid);
@@ -177,7 +268,7 @@ public:
 
     if (parent(kid) != id) {
       parent(kid) = id;
-      kids(id).push_back(kid);
+      addKid(id, kid);
     }
   }
 
@@ -187,21 +278,7 @@ public:
       roots.unify(kid, id);
   }
 
-  inline void makeKids() {
-    kid_data = std::move(JDataTable<jnid_t>(max_id));
-
-    std::vector<size_t> kids_size(size(), 0);
-    for (jnid_t id = 0; id != size(); ++id) {
-      newKids(id, kids_size[id]);
-      if (parent(id) != INVALID_JNID)
-        kids_size.at(parent(id)) += 1;
-    }
-
-    for (jnid_t id = 0; id != size(); ++id) {
-      if (parent(id) != INVALID_JNID)
-        kids(parent(id)).push_back(id);
-    }
-  }
+  void makeKids();
 
 
   inline void newPst(jnid_t id, size_t max_size) {
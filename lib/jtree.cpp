@@ -160,7 +160,7 @@ void JTree::insertSequence(GraphType const &graph, std::vector<vid_t> const &seq
     for (jnid_t kid = 0; kid < jnodes.size(); ++kid) {
       if (jnodes.parent(kid) == INVALID_JNID && kid != current) {
         jnodes.parent(kid) = current;
-        jnodes.kids(current).push_back(kid);
+        jnodes.addKid(current, kid);
       }
     }
     jnodes.adoptKids(current);
@@ -197,7 +197,7 @@ void JTree::insertSequence(GraphType const &graph, std::vector<vid_t> const &seq
 
       jnodes.newKids(current, 1);
       jnodes.parent(previous) = current;
-      jnodes.kids(current).push_back(previous);
+      jnodes.addKid(current, previous);
       jnodes.adoptKids(current);
 
       jnodes.newPst(current, graph.isNode(X) ? graph.getDeg(X) : 0);
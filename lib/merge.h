@@ -29,6 +29,7 @@
 
 #pragma once
 
+#include <limits>
 #include <queue>
 
 #include "defs.h"
@@ -29,8 +29,10 @@
 
 #include "partition.h"
 
+#include <atomic>
 #include <cstdlib>
 #include <limits>
+#include <memory>
 
 #include <mpi.h>
 #include <parallel/algorithm>
@@ -47,17 +49,105 @@ size_t get_weight(JNodeTable const &jnodes, jnid_t id,
   return result;
 }
 
-Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable &jnodes, part_t np,
-    double balance_factor, bool vtx_weight, bool pst_weight, bool pre_weight) :
+std::vector<size_t> Partition::jnodeWeights(JNodeTable const &jnodes,
+    bool const vtx_weight, bool const pst_weight, bool const pre_weight)
+{
+  std::vector<size_t> weights(jnodes.size());
+  #pragma omp parallel for
+  for (jnid_t id = 0; id < jnodes.size(); ++id)
+    weights[id] = get_weight(jnodes, id, vtx_weight, pst_weight, pre_weight);
+  return weights;
+}
+
+Partition::Sweep::Sweep(JNodeTable const &jnodes, std::vector<size_t> jnode_weights) :
+  weights(std::move(jnode_weights)), total_weight(0), kid_offsets(jnodes.size() + 1, 0), kids()
+{
+  assert(weights.size() == jnodes.size());
+  // Kids come before their parents, so one pass sums every subtree.
+  std::vector<size_t> subtree(weights);
+  for (jnid_t id = 0; id != jnodes.size(); ++id) {
+    total_weight += weights[id];
+    kid_offsets[id + 1] = kid_offsets[id] + jnodes.kids(id).size();
+    if (jnodes.parent(id) != INVALID_JNID)
+      subtree[jnodes.parent(id)] += subtree[id];
+  }
+
+  kids.resize(kid_offsets.back());
+  #pragma omp parallel for schedule(dynamic, 4 * KILO)
+  for (jnid_t id = 0; id < jnodes.size(); ++id) {
+    std::copy(jnodes.kids(id).cbegin(), jnodes.kids(id).cend(), kids.begin() + kid_offsets[id]);
+    std::sort(kids.begin() + kid_offsets[id], kids.begin() + kid_offsets[id + 1],
+    [&subtree](jnid_t const lhs, jnid_t const rhs) {
+      return subtree[lhs] > subtree[rhs] || (subtree[lhs] == subtree[rhs] && lhs < rhs); });
+  }
+}
+
+/* A component's kids in the order they are cut: largest component first, then in the sweep's order.
+ * The sweep's order already is that until a kid's own subtree is cut, and then the kids are copied
+ * into scratch and re-sorted. Kids that are not in the component (in_component is false) are left out. */
+template <typename InComponent>
+static std::pair<jnid_t const*, jnid_t const*> cutOrder(Partition::Sweep const &sweep, jnid_t const id,
+    std::vector<size_t> const &component_below, InComponent const &in_component, std::vector<jnid_t> &scratch)
+{
+  jnid_t const *const beg = sweep.kidsBegin(id);
+  jnid_t const *const end = sweep.kidsEnd(id);
+  bool ordered = true;
+  for (jnid_t const *kid = beg; ordered && kid != end; ++kid)
+    ordered = in_component(*kid) && (kid == beg || component_below[kid[-1]] >= component_below[*kid]);
+  if (ordered)
+    return std::make_pair(beg, end);
+
+  scratch.clear();
+  for (jnid_t const *kid = beg; kid != end; ++kid)
+    if (in_component(*kid))
+      scratch.push_back(*kid);
+  std::stable_sort(scratch.begin(), scratch.end(), [&component_below](jnid_t const lhs, jnid_t const rhs) {
+    return component_below[lhs] > component_below[rhs]; });
+  return std::make_pair(scratch.data(), scratch.data() + scratch.size());
+}
+
+/* While the tree is packed, a split jnode's pieces are recorded by jnid, and the piece that stays in the tree
+ * has no part (INVALID_PART) until the end. This gives it its part, moves the pieces to vids,
+ * merges pieces that landed in the same part and sorts them by vid, then part. */
+static void finishReplicas(std::vector<Partition::Replica> &replicas, std::vector<part_t> const &jnid_parts,
+    std::vector<jnid_t> const &seq)
+{
+  for (Partition::Replica &replica : replicas) {
+    if (replica.part == INVALID_PART)
+      replica.part = jnid_parts.at(replica.vid);
+    replica.vid = seq.at(replica.vid);
+  }
+  std::sort(replicas.begin(), replicas.end(), [](Partition::Replica const &lhs, Partition::Replica const &rhs) {
+    return lhs.vid < rhs.vid || (lhs.vid == rhs.vid && lhs.part < rhs.part); });
+
+  size_t count = 0;
+  for (size_t i = 0; i != replicas.size(); ++i) {
+    if (count != 0 && replicas[count - 1].vid == replicas[i].vid && replicas[count - 1].part == replicas[i].part)
+      replicas[count - 1].weight += replicas[i].weight;
+    else
+      replicas[count++] = replicas[i];
+  }
+  replicas.resize(count);
+}
+
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, part_t np,
+    double balance_factor, bool vtx_weight, bool pst_weight, bool pre_weight, bool parallel) :
+  Partition(seq, jnodes, Sweep(jnodes, jnodeWeights(jnodes, vtx_weight, pst_weight, pre_weight)), np,
+      balance_factor, parallel) {}
+
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+    part_t np, double balance_factor, bool parallel, bool split_hubs) :
   parts(jnodes.size(), INVALID_PART), num_parts(np)
 {
-  size_t total_weight = 0;
-  for (jnid_t id = 0; id != jnodes.size(); ++id)
-    total_weight += get_weight(jnodes, id, vtx_weight, pst_weight, pre_weight);
-  size_t max_component = (total_weight / num_parts) * balance_factor;
+  assert(sweep.weights.size() == jnodes.size());
+  std::vector<size_t> const max_components = maxComponents(sweep.total_weight, balance_factor);
 
   // For each jnid_t, assign a part.
-  forwardPartition(jnodes, max_component, vtx_weight, pst_weight, pre_weight);
+  if (parallel)
+    parallelForwardPartition(jnodes, sweep, max_components, split_hubs);
+  else
+    forwardPartition(jnodes, sweep, max_components, split_hubs);
+  finishReplicas(replicas, parts, seq);
 
   // Convert jnid_t-indexed parts to vid_t indexed parts.
   std::vector<part_t> tmp(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_PART);
@@ -66,6 +156,232 @@ Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable &jnodes, part_t
   parts = std::move(tmp);
 }
 
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+    std::vector<double> const &caps, double balance_factor, bool parallel, bool split_hubs) :
+  parts(jnodes.size(), INVALID_PART), num_parts(caps.size()), radices(), capacities(caps), replicas()
+{
+  assert(sweep.weights.size() == jnodes.size());
+  assert(!capacities.empty());
+  std::vector<size_t> const max_components = maxComponents(sweep.total_weight, balance_factor);
+
+  // For each jnid_t, assign a part.
+  if (parallel)
+    parallelForwardPartition(jnodes, sweep, max_components, split_hubs);
+  else
+    forwardPartition(jnodes, sweep, max_components, split_hubs);
+  finishReplicas(replicas, parts, seq);
+
+  // Convert jnid_t-indexed parts to vid_t indexed parts.
+  std::vector<part_t> tmp(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_PART);
+  for (size_t i = 0; i != seq.size(); ++i)
+    tmp.at(seq.at(i)) = parts.at(i);
+  parts = std::move(tmp);
+}
+
+std::vector<double> Partition::relativeCapacities(size_t const count) const
+{
+  if (capacities.empty())
+    return std::vector<double>(count, 1.0);
+
+  double total_capacity = 0.0;
+  for (double const capacity : capacities)
+    total_capacity += capacity;
+  double const largest = *std::max_element(capacities.cbegin(), capacities.cend());
+  std::vector<double> result(count);
+  for (size_t part = 0; part != count; ++part)
+    result[part] = (part < capacities.size() ? capacities[part] : largest) * num_parts / total_capacity;
+  return result;
+}
+
+std::vector<size_t> Partition::maxComponents(size_t const total_weight, double const balance_factor) const
+{
+  // Equal parts keep the integer average, as they always have.
+  if (capacities.empty())
+    return std::vector<size_t>(num_parts, (total_weight / num_parts) * balance_factor);
+
+  std::vector<double> const relative = relativeCapacities(num_parts);
+  std::vector<size_t> result(num_parts);
+  for (part_t part = 0; part != num_parts; ++part)
+    result[part] = ((double) total_weight / num_parts) * relative[part] * balance_factor;
+  return result;
+}
+
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes,
+    std::vector< std::vector<size_t> > const &weights, part_t np, double balance_factor) :
+  parts(jnodes.size(), INVALID_PART), num_parts(np), radices()
+{
+  std::vector<size_t> max_components;
+  for (std::vector<size_t> const &dimension : weights) {
+    assert(dimension.size() == jnodes.size());
+    size_t total_weight = 0;
+    #pragma omp parallel for reduction(+:total_weight)
+    for (jnid_t id = 0; id < jnodes.size(); ++id)
+      total_weight += dimension[id];
+    max_components.push_back((total_weight / num_parts) * balance_factor);
+  }
+  multiForwardPartition(jnodes, weights, max_components);
+
+  // Convert jnid_t-indexed parts to vid_t indexed parts.
+  std::vector<part_t> tmp(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_PART);
+  for (size_t i = 0; i != seq.size(); ++i)
+    tmp.at(seq.at(i)) = parts.at(i);
+  parts = std::move(tmp);
+}
+
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+    Partition const &previous, part_t np, double balance_factor) :
+  parts(jnodes.size(), INVALID_PART), num_parts(np), radices()
+{
+  assert(sweep.weights.size() == jnodes.size());
+  size_t max_component = (sweep.total_weight / num_parts) * balance_factor;
+
+  // Vertices that are new since the previous partition have no part to keep.
+  std::vector<part_t> previous_parts(seq.size(), INVALID_PART);
+  #pragma omp parallel for
+  for (size_t i = 0; i < seq.size(); ++i)
+    if (seq[i] < previous.parts.size())
+      previous_parts[i] = previous.parts[seq[i]];
+  migratingForwardPartition(jnodes, sweep, max_component, previous_parts);
+
+  // Convert jnid_t-indexed parts to vid_t indexed parts.
+  std::vector<part_t> tmp(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_PART);
+  for (size_t i = 0; i != seq.size(); ++i)
+    tmp.at(seq.at(i)) = parts.at(i);
+  parts = std::move(tmp);
+}
+
+double Partition::balance(std::vector<vid_t> const &seq, std::vector<size_t> const &weights) const
+{
+  std::vector<size_t> part_weight(partCount(), 0);
+  size_t total_weight = 0;
+  for (size_t i = 0; i != seq.size(); ++i) {
+    part_weight.at(parts.at(seq[i])) += weights[i];
+    total_weight += weights[i];
+  }
+
+  // A split vertex's weight is spread over its pieces' parts, in proportion to the pieces.
+  std::vector<vid_t> pos;
+  if (!replicas.empty()) {
+    pos.assign(parts.size(), INVALID_VID);
+    for (size_t i = 0; i != seq.size(); ++i)
+      pos[seq[i]] = i;
+  }
+  for (auto beg = replicas.cbegin(); beg != replicas.cend(); ) {
+    auto end = beg;
+    size_t pieces_weight = 0;
+    for (; end != replicas.cend() && end->vid == beg->vid; ++end)
+      pieces_weight += end->weight;
+    size_t const weight = weights[pos[beg->vid]];
+    part_weight.at(parts.at(beg->vid)) -= weight;
+    size_t dealt = 0;
+    for (; beg != end; ++beg) {
+      size_t const share = beg + 1 == end ? weight - dealt : weight * beg->weight / pieces_weight;
+      part_weight.at(beg->part) += share;
+      dealt += share;
+    }
+  }
+  std::vector<double> const relative = relativeCapacities(part_weight.size());
+  double result = 0.0;
+  for (size_t part = 0; part != part_weight.size(); ++part)
+    result = std::max(result, (double) part_weight[part] / ((double) total_weight / num_parts * relative[part]));
+  return result;
+}
+
+double Partition::imbalance(std::vector<size_t> const &part_weight, size_t const total) const
+{
+  // Equal parts are measured against the integer average, as they always have been,
+  // unless there is less weight than parts and that average is 0.
+  if (total == 0)
+    return 0.0;
+  if (capacities.empty())
+    return (double) *std::max_element(part_weight.cbegin(), part_weight.cend()) /
+      (total >= (size_t) num_parts ? total / num_parts : (double) total / num_parts);
+
+  std::vector<double> const relative = relativeCapacities(part_weight.size());
+  double result = 0.0;
+  for (size_t part = 0; part != part_weight.size(); ++part)
+    result = std::max(result, (double) part_weight[part] / ((double) total / num_parts * relative[part]));
+  return result;
+}
+
+part_t Partition::ownerPart(vid_t const X, vid_t const Y) const
+{
+  if (replicas.empty())
+    return parts[X];
+  auto itr = std::lower_bound(replicas.cbegin(), replicas.cend(), X,
+      [](Replica const &replica, vid_t const vid) { return replica.vid < vid; });
+  if (itr == replicas.cend() || itr->vid != X)
+    return parts[X];
+
+  size_t pieces_weight = 0;
+  for (auto end = itr; end != replicas.cend() && end->vid == X; ++end)
+    pieces_weight += end->weight;
+  // The splitmix64 finalizer, so that Ys with common low bits are spread over the pieces too.
+  uint64_t hash = (uint64_t) Y + 0x9e3779b97f4a7c15ull;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  uint64_t ticket = (hash ^ (hash >> 31)) % std::max<size_t>(1, pieces_weight);
+  for (; itr + 1 != replicas.cend() && (itr + 1)->vid == X && ticket >= itr->weight; ++itr)
+    ticket -= itr->weight;
+  return itr->part;
+}
+
+part_t Partition::partCount() const
+{
+  part_t result = *std::max_element(parts.cbegin(), parts.cend()) + 1;
+  for (Replica const &replica : replicas)
+    result = std::max<part_t>(result, replica.part + 1);
+  return result;
+}
+
+size_t Partition::migration(std::vector<vid_t> const &seq, std::vector<size_t> const &weights,
+    Partition const &previous) const
+{
+  size_t moved = 0;
+  #pragma omp parallel for reduction(+:moved)
+  for (size_t i = 0; i < seq.size(); ++i) {
+    vid_t const X = seq[i];
+    if (X < previous.parts.size() && previous.parts[X] != INVALID_PART && previous.parts[X] != parts[X])
+      moved += weights[i];
+  }
+  return moved;
+}
+
+Partition::Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+    std::vector<part_t> const &fanouts, std::vector<double> const &balance_factors) :
+  parts(jnodes.size(), INVALID_PART), num_parts(1), radices()
+{
+  std::vector<size_t> const &weights = sweep.weights;
+  assert(weights.size() == jnodes.size());
+  assert(fanouts.size() == balance_factors.size());
+
+  // ids holds each jnid's part id so far; each level's groups are the parts of the levels above.
+  std::vector<part_t> ids(jnodes.size(), 0);
+  for (size_t level = 0; level != fanouts.size(); ++level) {
+    std::vector<size_t> group_weight(num_parts, 0);
+    for (jnid_t id = 0; id != jnodes.size(); ++id)
+      group_weight[ids[id]] += weights[id];
+
+    std::vector< std::vector<size_t> > max_components(num_parts);
+    for (part_t group = 0; group != num_parts; ++group)
+      max_components[group].assign(1, (group_weight[group] / fanouts[level]) * balance_factors[level]);
+
+    parts.assign(jnodes.size(), INVALID_PART);
+    size_t const radix = std::max<size_t>(fanouts[level], forwardPartition(jnodes, sweep, ids, max_components));
+    assert(num_parts * radix <= (size_t) std::numeric_limits<part_t>::max());
+
+    for (jnid_t id = 0; id != jnodes.size(); ++id)
+      ids[id] = ids[id] * radix + parts[id];
+    radices.push_back(radix);
+    num_parts *= radix;
+  }
+
+  // Convert jnid_t-indexed parts to vid_t indexed parts.
+  parts.assign(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_PART);
+  for (size_t i = 0; i != seq.size(); ++i)
+    parts.at(seq.at(i)) = ids.at(i);
+}
+
 void Partition::mpi_sync()
 {
   vid_t max_vid = parts.size();
@@ -73,9 +389,9 @@ void Partition::mpi_sync()
   MPI_Bcast(&max_vid, 1, MPI_vid_t, 0, MPI_COMM_WORLD);
   parts.resize(max_vid, INVALID_PART);
 
-  assert(sizeof(part_t) == 2);
-  MPI_Bcast(parts.data(), parts.size(), MPI_SHORT, 0, MPI_COMM_WORLD);
-  MPI_Bcast(&num_parts, 1, MPI_SHORT, 0, MPI_COMM_WORLD);
+  MPI_Datatype MPI_part_t = sizeof(part_t) == 2 ? MPI_SHORT : MPI_INT32_T;
+  MPI_Bcast(parts.data(), parts.size(), MPI_part_t, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&num_parts, 1, MPI_part_t, 0, MPI_COMM_WORLD);
 }
 
 
@@ -83,9 +399,185 @@ void Partition::mpi_sync()
 /* 
  * TREE PARTITIONING ALGORITHMS
  */
-void Partition::forwardPartition(JNodeTable &jnodes, size_t const max_component,
-    bool const vtx_weight, bool const pst_weight, bool const pre_weight)
+
+/* The open bins of a first-fit packing, indexed by a segment tree of the most room left in each range,
+ * so that the first (or last) bin with room for a component is found in O(log k) rather than O(k).
+ * Bin B opens with capacities[B], and bins past the end of capacities with the largest of them. */
+class BinIndex {
+public:
+  inline BinIndex(std::vector<size_t> const &capacities) :
+    capacities(capacities), largest(*std::max_element(capacities.cbegin(), capacities.cend())),
+    count(0), leaves(1), room(2, -1) {}
+
+  inline BinIndex(size_t const capacity) : BinIndex(std::vector<size_t>(1, capacity)) {}
+
+  inline size_t size() const { return count; }
+
+  inline void open() {
+    if (count == leaves) {
+      std::vector<int64_t> tmp(4 * leaves, -1);
+      std::copy(room.cbegin() + leaves, room.cend(), tmp.begin() + 2 * leaves);
+      leaves *= 2;
+      room = std::move(tmp);
+      for (size_t node = leaves - 1; node != 0; --node)
+        room[node] = std::max(room[2 * node], room[2 * node + 1]);
+    }
+    set(count, count < capacities.size() ? capacities[count] : largest);
+    ++count;
+  }
+
+  inline void add(size_t const bin, size_t const weight) { set(bin, room[leaves + bin] - weight); }
+  inline void remove(size_t const bin, size_t const weight) { set(bin, room[leaves + bin] + weight); }
+
+  inline bool fits(size_t const bin, size_t const weight) const { return room[leaves + bin] >= (int64_t) weight; }
+
+  // Both return size() if no open bin has room for weight.
+  inline size_t firstFit(size_t const weight) const { return find(weight, false); }
+  inline size_t lastFit(size_t const weight) const { return find(weight, true); }
+  // The first open bin with the most room, or size() if none is open.
+  inline size_t roomiest() const { return count == 0 ? count : find(room[1], false); }
+
+private:
+  std::vector<size_t> const capacities;
+  size_t const largest;
+  size_t count;
+  size_t leaves;
+  // Unopened bins have less room than any component, even an empty one.
+  std::vector<int64_t> room;
+
+  inline void set(size_t const bin, int64_t const bin_room) {
+    size_t node = leaves + bin;
+    room[node] = bin_room;
+    for (node /= 2; node != 0; node /= 2)
+      room[node] = std::max(room[2 * node], room[2 * node + 1]);
+  }
+
+  inline size_t find(size_t const weight, bool const last) const {
+    if (room[1] < (int64_t) weight)
+      return count;
+    size_t node = 1;
+    while (node < leaves) {
+      size_t const first = last ? 2 * node + 1 : 2 * node;
+      node = room[first] >= (int64_t) weight ? first : first ^ 1;
+    }
+    return node - leaves;
+  }
+};
+
+/* A BinIndex over several weight dimensions, where a bin fits a component if it has room in every one.
+ * Each node of the segment tree keeps the most room in its range for each dimension separately.
+ * That only bounds what any one bin has, so a search may have to back out of a range,
+ * but it never enters a range that lacks room in some dimension, or less room than its best bin so far. */
+class MultiBinIndex {
+public:
+  inline MultiBinIndex(std::vector<size_t> const &capacities) :
+    capacities(capacities), dims(capacities.size()), count(0), leaves(1), room(2 * dims, -1) {}
+
+  inline size_t size() const { return count; }
+
+  inline void open() {
+    if (count == leaves) {
+      std::vector<int64_t> tmp(4 * leaves * dims, -1);
+      std::copy(room.cbegin() + leaves * dims, room.cend(), tmp.begin() + 2 * leaves * dims);
+      leaves *= 2;
+      room = std::move(tmp);
+      for (size_t node = leaves - 1; node != 0; --node)
+        pull(node);
+    }
+    size_t const bin = count++;
+    for (size_t d = 0; d != dims; ++d)
+      room[(leaves + bin) * dims + d] = capacities[d];
+    update(bin);
+  }
+
+  // weight points to one entry per dimension.
+  inline void add(size_t const bin, size_t const *const weight) {
+    for (size_t d = 0; d != dims; ++d)
+      room[(leaves + bin) * dims + d] -= weight[d];
+    update(bin);
+  }
+
+  /* The bin with the most room in dimension dim among those with room for weight, and the first such bin
+   * if there is a tie. Returns size() if no open bin has room for weight. */
+  inline size_t worstFit(size_t const *const weight, size_t const dim) const {
+    size_t best = count;
+    find(1, weight, dim, best);
+    return best;
+  }
+
+private:
+  std::vector<size_t> const capacities;
+  size_t const dims;
+  size_t count;
+  size_t leaves;
+  // Unopened bins have less room than any component, even an empty one.
+  std::vector<int64_t> room;
+
+  inline void pull(size_t const node) {
+    for (size_t d = 0; d != dims; ++d)
+      room[node * dims + d] = std::max(room[2 * node * dims + d], room[(2 * node + 1) * dims + d]);
+  }
+
+  inline void update(size_t const bin) {
+    for (size_t node = (leaves + bin) / 2; node != 0; node /= 2)
+      pull(node);
+  }
+
+  inline bool fits(size_t const node, size_t const *const weight) const {
+    for (size_t d = 0; d != dims; ++d)
+      if (room[node * dims + d] < (int64_t) weight[d])
+        return false;
+    return true;
+  }
+
+  inline void find(size_t const node, size_t const *const weight, size_t const dim, size_t &best) const {
+    if (!fits(node, weight) || (best != count && room[node * dims + dim] <= room[(leaves + best) * dims + dim]))
+      return;
+    if (node >= leaves) {
+      best = node - leaves;
+      return;
+    }
+    bool const right_first = room[(2 * node + 1) * dims + dim] > room[2 * node * dims + dim];
+    find(2 * node + right_first, weight, dim, best);
+    find(2 * node + !right_first, weight, dim, best);
+  }
+};
+
+void Partition::forwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+    std::vector<size_t> const &max_components, bool const split_hubs)
+{
+  forwardPartition(jnodes, sweep, std::vector<part_t>(jnodes.size(), 0),
+      std::vector< std::vector<size_t> >(1, max_components), split_hubs);
+}
+
+/* Splits a jnode that outweighs a part on its own: pieces of max_component, which any empty bin fits,
+ * are packed until what is left fits too. The pieces fill bins to the brim, and the rest stays in the tree. */
+static void splitHub(jnid_t const id, size_t &below, size_t const max_component, BinIndex &bins,
+    std::vector<Partition::Replica> &replicas)
+{
+  while (below > max_component) {
+    size_t const cur_part = bins.firstFit(max_component);
+    if (cur_part == bins.size())
+      bins.open();
+    bins.add(cur_part, max_component);
+    replicas.push_back(Partition::Replica{id, (part_t) cur_part, max_component});
+    below -= max_component;
+  }
+  replicas.push_back(Partition::Replica{id, INVALID_PART, below});
+}
+
+/* The forward partition of several groups of jnodes at once, each with its own bins: max_components[G][B]
+ * is the most bin B of group G may hold. A group's tree is cut into components that fit its smallest bin,
+ * so that any component fits any empty bin, and bins fill in order however their sizes differ.
+ * A jnode only joins its parent's component if both are in the same group, so groups are partitioned
+ * independently, in one pass. parts are numbered within each group. Returns the most bins any group used.
+ * Hubs may only be split with a single group, since replicas record parts, not parts within groups. */
+size_t Partition::forwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+    std::vector<part_t> const &groups, std::vector< std::vector<size_t> > const &max_components,
+    bool const split_hubs)
 {
+  std::vector<size_t> const &weights = sweep.weights;
+  assert(!split_hubs || max_components.size() == 1);
   // Classic algorithm modified for FFD binpacking.
   // 1. Count the uncut component below X.
   // 2. If component_below(X) > max_component, pack bins.
@@ -94,66 +586,433 @@ void Partition::forwardPartition(JNodeTable &jnodes, size_t const max_component,
   // 2. Try packing half-size components since this is ideal for bin packing.
   // 3. Move to edge-weighted stuff if you want to minimize edge cuts.
   // 4. Spend more time reasoning about optimization criteria for communication volume.
-  std::vector<size_t> part_size;
+  std::vector<BinIndex> group_bins;
+  std::vector<size_t> group_min;
+  for (std::vector<size_t> const &bin_capacities : max_components) {
+    group_bins.emplace_back(bin_capacities);
+    group_min.push_back(*std::min_element(bin_capacities.cbegin(), bin_capacities.cend()));
+  }
+  auto same_group = [&groups](jnid_t const lhs, jnid_t const rhs) { return groups[lhs] == groups[rhs]; };
+
   std::vector<size_t> component_below(jnodes.size(), 0);
+  // Kids are never sorted in place, so the tree can be shared by several partitions at once.
+  std::vector<jnid_t> scratch;
   for (jnid_t id = 0; id != jnodes.size(); ++id)
   {
-    component_below.at(id) += get_weight(jnodes, id, vtx_weight, pst_weight, pre_weight);
+    BinIndex &bins = group_bins.at(groups[id]);
+    size_t const max_component = group_min[groups[id]];
+
+    component_below.at(id) += weights.at(id);
     if (component_below.at(id) > max_component)
     {
-      std::sort(jnodes.kids(id).begin(), jnodes.kids(id).end(),
-      [&component_below](jnid_t const lhs, jnid_t const rhs) {
-        return component_below.at(lhs) > component_below.at(rhs); });
+      auto const kids = cutOrder(sweep, id, component_below,
+          [&](jnid_t const kid) { return same_group(kid, id); }, scratch);
 
       // Try to pack kids
+      bool unpacked;
       do {
-        for (auto itr = jnodes.kids(id).cbegin(); component_below.at(id) > max_component &&
-                  itr!= jnodes.kids(id).cend(); ++itr)
+        unpacked = false;
+        for (jnid_t const *itr = kids.first; component_below.at(id) > max_component &&
+                  itr != kids.second; ++itr)
         {
           jnid_t const kid = *itr;
           assert(component_below.at(kid) <= max_component);
           if (parts.at(kid) != INVALID_PART) continue;
 
           // Find a part (bin) for this kid.
-          for (part_t cur_part = 0; cur_part != (part_t) part_size.size(); ++cur_part) {
-            // If kid packs...
-            if (part_size.at(cur_part) + component_below.at(kid) <= max_component) {
-              component_below.at(id) -= component_below.at(kid);
-              part_size.at(cur_part) += component_below.at(kid);
-              parts.at(kid) = cur_part;
-              break;
-            }
+          size_t const cur_part = bins.firstFit(component_below.at(kid));
+          // If kid packs...
+          if (cur_part != bins.size()) {
+            component_below.at(id) -= component_below.at(kid);
+            bins.add(cur_part, component_below.at(kid));
+            parts.at(kid) = cur_part;
+          }
+          else {
+            unpacked = true;
           }
         }
         // If packing fails, open a new part (bin)
-        if (component_below.at(id) > max_component)
-          part_size.push_back(0);
-      } while(component_below.at(id) > max_component);
+        if (component_below.at(id) > max_component && unpacked)
+          bins.open();
+      } while(component_below.at(id) > max_component && unpacked);
+
+      // With every kid packed, id alone outweighs a part. If hubs are split, all of id's pieces but the last
+      // are packed now and the last stays in the tree; otherwise id gets a part of its own.
+      // This only happens when there are nearly as many parts as heavy jnodes.
+      if (component_below.at(id) > max_component && split_hubs && max_component != 0)
+        splitHub(id, component_below.at(id), max_component, bins, replicas);
+      if (component_below.at(id) > max_component) {
+        bins.open();
+        bins.add(bins.size() - 1, component_below.at(id));
+        parts.at(id) = bins.size() - 1;
+        component_below.at(id) = 0;
+      }
     }
     assert(component_below.at(id) <= max_component);
-    if (jnodes.parent(id) != INVALID_JNID)
+    if (jnodes.parent(id) != INVALID_JNID && same_group(jnodes.parent(id), id))
       component_below.at(jnodes.parent(id)) += component_below.at(id);
   }
 
   /* At the conclusion of the loop, parts are only assigned to "cut" vertices.
    * So, push part assignments down the tree to vertices that don't yet have them. */
   for (jnid_t id = jnodes.size() - 1; id != (jnid_t)-1; --id) {
-    if (parts.at(id) == INVALID_PART && jnodes.parent(id) != INVALID_JNID)
+    if (parts.at(id) == INVALID_PART && jnodes.parent(id) != INVALID_JNID && same_group(jnodes.parent(id), id))
       parts.at(id) = parts.at(jnodes.parent(id));
 
-    // If id is a root, then it needs to be packed into a bin.
+    // If id is a root of its group, then it needs to be packed into a bin.
+    BinIndex &bins = group_bins.at(groups[id]);
     while (parts.at(id) == INVALID_PART) {
-      for (part_t cur_part = part_size.size() - 1; cur_part != -1; --cur_part) {
-        if (part_size.at(cur_part) + component_below.at(id) <= max_component) {
-          part_size.at(cur_part) += component_below.at(id);
-          parts.at(id) = cur_part;
+      size_t const cur_part = bins.lastFit(component_below.at(id));
+      if (cur_part != bins.size()) {
+        bins.add(cur_part, component_below.at(id));
+        parts.at(id) = cur_part;
+      }
+      else {
+        bins.open();
+      }
+    }
+  }
+
+  size_t most_bins = 0;
+  for (BinIndex const &bins : group_bins)
+    most_bins = std::max(most_bins, bins.size());
+  return most_bins;
+}
+
+/* forwardPartition with a weight vector per jnode: weights[d][id] is jnode id's weight in dimension d,
+ * and a component fits only if it is within max_components[d] in every dimension d.
+ * Packing kids as they are cut, as forwardPartition does, fills every bin in whichever dimension the early
+ * components are heavy in, and then the late components fit nowhere. So, like parallelForwardPartition,
+ * this cuts the whole tree first and then packs the components, largest share of a limit first.
+ * Each goes to the bin with the most room in the dimension it is heaviest in, so bins fill evenly in all. */
+void Partition::multiForwardPartition(JNodeTable const &jnodes, std::vector< std::vector<size_t> > const &weights,
+    std::vector<size_t> const &max_components)
+{
+  size_t const dims = weights.size();
+
+  std::vector<size_t> component_below(jnodes.size() * dims, 0);
+  auto below = [&component_below, dims](jnid_t const id) { return component_below.data() + id * dims; };
+  auto fits = [&max_components, dims](size_t const *const weight) {
+    for (size_t d = 0; d != dims; ++d)
+      if (weight[d] > max_components[d])
+        return false;
+    return true;
+  };
+  // A component's load is its largest share of any dimension's limit, and its heaviest dimension is that one.
+  auto heaviest = [&](jnid_t const id) {
+    size_t result = 0;
+    for (size_t d = 1; d != dims; ++d)
+      if ((double) below(id)[d] / std::max<size_t>(1, max_components[d]) >
+          (double) below(id)[result] / std::max<size_t>(1, max_components[result]))
+        result = d;
+    return result;
+  };
+  auto load = [&](jnid_t const id) {
+    size_t const d = heaviest(id);
+    return (double) below(id)[d] / std::max<size_t>(1, max_components[d]);
+  };
+  auto by_load = [&load](jnid_t const lhs, jnid_t const rhs) {
+    return load(lhs) > load(rhs) || (load(lhs) == load(rhs) && lhs < rhs); };
+
+  // Cut the largest kids until the component fits. A jnode that is over a limit on its own,
+  // and every root, heads a component too; neither joins its parent's.
+  std::vector<char> is_head(jnodes.size(), 0);
+  std::vector<jnid_t> kids;
+  for (jnid_t id = 0; id != jnodes.size(); ++id) {
+    for (size_t d = 0; d != dims; ++d)
+      below(id)[d] += weights[d][id];
+
+    if (!fits(below(id))) {
+      kids.clear();
+      for (jnid_t const kid : jnodes.kids(id))
+        if (!is_head[kid])
+          kids.push_back(kid);
+      std::sort(kids.begin(), kids.end(), by_load);
+      for (auto itr = kids.cbegin(); !fits(below(id)) && itr != kids.cend(); ++itr) {
+        is_head[*itr] = 1;
+        for (size_t d = 0; d != dims; ++d)
+          below(id)[d] -= below(*itr)[d];
+      }
+    }
+
+    if (jnodes.parent(id) == INVALID_JNID || !fits(below(id)))
+      is_head[id] = 1;
+    else
+      for (size_t d = 0; d != dims; ++d)
+        below(jnodes.parent(id))[d] += below(id)[d];
+  }
+
+  std::vector<jnid_t> heads;
+  for (jnid_t id = 0; id != jnodes.size(); ++id)
+    if (is_head[id])
+      heads.push_back(id);
+  std::sort(heads.begin(), heads.end(), by_load);
+
+  MultiBinIndex bins(max_components);
+  while (bins.size() != (size_t) num_parts)
+    bins.open();
+  for (jnid_t const head : heads) {
+    size_t cur_part = bins.worstFit(below(head), heaviest(head));
+    if (cur_part == bins.size())
+      bins.open();
+    bins.add(cur_part, below(head));
+    parts[head] = cur_part;
+  }
+
+  // Parents come after their kids, so a reverse pass pushes each head's part down its component.
+  for (jnid_t id = jnodes.size() - 1; id != (jnid_t)-1; --id)
+    if (!is_head[id])
+      parts[id] = parts[jnodes.parent(id)];
+}
+
+/* forwardPartition's packing step shares its bins across the whole tree, so it is inherently serial.
+ * The parallel variant splits it in two. Cutting only looks at a jnode and its kids: once every kid is
+ * finished, cut the largest kids until the component fits. So subtrees are cut bottom-up by whichever
+ * thread finishes the last kid of each jnode. The cut components (and the roots) are then packed
+ * first-fit decreasing, ordered by size and then jnid, and each bin is pushed down its components.
+ * Nothing depends on the schedule, so the result is the same for any number of threads.
+ *
+ * cutComponents is the cutting step. It marks the top jnode of each component in is_head,
+ * leaves the component's weight in component_below, and returns the heads in first-fit decreasing order.
+ * If previous parts are given, the tree is also cut wherever a jnode and its parent were in different parts. */
+static std::vector<jnid_t> cutComponents(JNodeTable const &jnodes, Partition::Sweep const &sweep,
+    size_t const max_component, std::vector<size_t> &component_below, std::vector<char> &is_head,
+    std::vector<part_t> const *const previous = nullptr)
+{
+  jnid_t const num_jnids = jnodes.size();
+  component_below.assign(num_jnids, 0);
+  is_head.assign(num_jnids, 0);
+  std::unique_ptr<std::atomic<jnid_t>[]> kids_left(new std::atomic<jnid_t>[num_jnids]);
+
+  #pragma omp parallel for
+  for (jnid_t id = 0; id < num_jnids; ++id) {
+    kids_left[id].store(jnodes.kids(id).size(), std::memory_order_relaxed);
+    if (previous != nullptr && jnodes.parent(id) != INVALID_JNID) {
+      part_t const part = (*previous)[id];
+      part_t const parent_part = (*previous)[jnodes.parent(id)];
+      is_head[id] = part != INVALID_PART && parent_part != INVALID_PART && part != parent_part;
+    }
+  }
+
+  // Every leaf starts a climb, which carries on for as long as it finishes the last kid of its parent.
+  #pragma omp parallel
+  {
+    std::vector<jnid_t> scratch;
+    #pragma omp for schedule(dynamic, 4 * KILO)
+    for (jnid_t leaf = 0; leaf < num_jnids; ++leaf) {
+      if (jnodes.kids(leaf).size() != 0)
+        continue;
+
+      for (jnid_t id = leaf; id != INVALID_JNID; id = jnodes.parent(id)) {
+        // A kid that is already a head outweighed a part on its own, or left its previous part, so it is cut already.
+        size_t &below = component_below[id];
+        below = sweep.weights[id];
+        for (jnid_t const kid : jnodes.kids(id))
+          if (!is_head[kid])
+            below += component_below[kid];
+
+        if (below > max_component) {
+          auto const kids = cutOrder(sweep, id, component_below,
+              [&is_head](jnid_t const kid) { return !is_head[kid]; }, scratch);
+          for (jnid_t const *itr = kids.first; below > max_component && itr != kids.second; ++itr) {
+            is_head[*itr] = 1;
+            below -= component_below[*itr];
+          }
+        }
+
+        if (jnodes.parent(id) == INVALID_JNID || below > max_component)
+          is_head[id] = 1;
+        if (jnodes.parent(id) == INVALID_JNID ||
+            kids_left[jnodes.parent(id)].fetch_sub(1, std::memory_order_acq_rel) != 1)
           break;
+      }
+    }
+  }
+
+  std::vector<jnid_t> heads;
+  #pragma omp parallel
+  {
+    std::vector<jnid_t> local_heads;
+    #pragma omp for schedule(static) nowait
+    for (jnid_t id = 0; id < num_jnids; ++id)
+      if (is_head[id])
+        local_heads.push_back(id);
+    #pragma omp critical(parallel_forward_heads)
+    heads.insert(heads.end(), local_heads.cbegin(), local_heads.cend());
+  }
+  __gnu_parallel::sort(heads.begin(), heads.end(), [&component_below](jnid_t const lhs, jnid_t const rhs) {
+    return component_below[lhs] > component_below[rhs] ||
+      (component_below[lhs] == component_below[rhs] && lhs < rhs); });
+
+  return heads;
+}
+
+void Partition::parallelForwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+    std::vector<size_t> const &max_components, bool const split_hubs)
+{
+  // Components fit the smallest bin, so that any of them fits any empty bin.
+  size_t const max_component = *std::min_element(max_components.cbegin(), max_components.cend());
+  std::vector<size_t> component_below;
+  std::vector<char> is_head;
+  std::vector<jnid_t> heads = cutComponents(jnodes, sweep, max_component, component_below, is_head);
+
+  BinIndex bins(max_components);
+
+  // The heads still over the limit outweigh a part on their own, and they come first.
+  // If they are split, their full pieces are packed first, and each keeps what is left as its component.
+  if (split_hubs && max_component != 0 && !heads.empty() && component_below[heads.front()] > max_component) {
+    for (jnid_t const head : heads) {
+      if (component_below[head] <= max_component)
+        break;
+      splitHub(head, component_below[head], max_component, bins, replicas);
+    }
+    std::sort(heads.begin(), heads.end(), [&component_below](jnid_t const lhs, jnid_t const rhs) {
+      return component_below[lhs] > component_below[rhs] ||
+        (component_below[lhs] == component_below[rhs] && lhs < rhs); });
+  }
+
+  for (jnid_t const head : heads) {
+    size_t const cur_part = bins.firstFit(component_below[head]);
+    if (cur_part == bins.size())
+      bins.open();
+    bins.add(cur_part, component_below[head]);
+    parts[head] = cur_part;
+  }
+
+  // Each head's component ends at the heads below it, so the components can be filled in independently.
+  #pragma omp parallel
+  {
+    std::vector<jnid_t> stack;
+    #pragma omp for schedule(dynamic, 64)
+    for (size_t idx = 0; idx < heads.size(); ++idx) {
+      part_t const part = parts[heads[idx]];
+      stack.push_back(heads[idx]);
+      while (!stack.empty()) {
+        jnid_t const id = stack.back();
+        stack.pop_back();
+        for (jnid_t const kid : jnodes.kids(id)) {
+          if (!is_head[kid]) {
+            parts[kid] = part;
+            stack.push_back(kid);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* A repartition cuts the new tree like parallelForwardPartition, but packs its components to keep vertices
+ * where the previous partition had them. The tree is also cut wherever the previous partition cut it,
+ * so unchanged subtrees come out as components of their own. Each component prefers the previous part
+ * that held most of its weight, and bin P is previous part P. Components go to their preferred bins first,
+ * those keeping the most weight first. The rest are matched to bins a previous part at a time, and whatever
+ * still does not fit is packed first-fit decreasing. With pst weights, the weight kept is the number of edges
+ * that stay put under ECV(down). previous is jnid-indexed. */
+void Partition::migratingForwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+    size_t const max_component, std::vector<part_t> const &previous)
+{
+  std::vector<size_t> const &weights = sweep.weights;
+  std::vector<size_t> component_below;
+  std::vector<char> is_head;
+  std::vector<jnid_t> const heads =
+    cutComponents(jnodes, sweep, max_component, component_below, is_head, &previous);
+
+  // Find each component's jnodes and its preferred part. Each vertex also counts for one,
+  // so that a component of weightless vertices still prefers to stay where it was.
+  part_t const previous_parts = *std::max_element(previous.cbegin(), previous.cend()) + 1;
+  std::vector<jnid_t> component(jnodes.size());
+  std::vector<part_t> preferred(heads.size(), INVALID_PART);
+  std::vector<size_t> kept(heads.size(), 0);
+  #pragma omp parallel
+  {
+    std::vector<size_t> overlap(previous_parts, 0);
+    std::vector<part_t> touched;
+    std::vector<jnid_t> stack;
+    #pragma omp for schedule(dynamic, 64)
+    for (size_t idx = 0; idx < heads.size(); ++idx) {
+      stack.push_back(heads[idx]);
+      while (!stack.empty()) {
+        jnid_t const id = stack.back();
+        stack.pop_back();
+        component[id] = idx;
+        if (previous[id] != INVALID_PART) {
+          if (overlap[previous[id]] == 0)
+            touched.push_back(previous[id]);
+          overlap[previous[id]] += weights[id] + 1;
         }
+        for (jnid_t const kid : jnodes.kids(id))
+          if (!is_head[kid])
+            stack.push_back(kid);
       }
-      if (parts.at(id) == INVALID_PART)
-        part_size.push_back(0);
+
+      for (part_t const part : touched) {
+        if (overlap[part] > kept[idx] || (overlap[part] == kept[idx] && part < preferred[idx])) {
+          kept[idx] = overlap[part];
+          preferred[idx] = part;
+        }
+        overlap[part] = 0;
+      }
+      touched.clear();
+    }
+  }
+
+  // heads is in first-fit decreasing order, so ties in kept weight go to the larger component.
+  std::vector<size_t> order(heads.size());
+  for (size_t idx = 0; idx != heads.size(); ++idx)
+    order[idx] = idx;
+  std::stable_sort(order.begin(), order.end(), [&kept](size_t const lhs, size_t const rhs) {
+    return kept[lhs] > kept[rhs]; });
+
+  BinIndex bins(max_component);
+  while (bins.size() != (size_t) num_parts)
+    bins.open();
+  std::vector<part_t> bin(heads.size(), INVALID_PART);
+  for (size_t const idx : order) {
+    part_t const part = preferred[idx];
+    if (part != INVALID_PART && part < num_parts && bins.fits(part, component_below[heads[idx]])) {
+      bins.add(part, component_below[heads[idx]]);
+      bin[idx] = part;
+    }
+  }
+
+  // The leftovers of each previous part are matched to a new bin together if they fit in one,
+  // which keeps them together when their own bin is full or when there are fewer parts than before.
+  std::vector<size_t> leftover_weight(previous_parts, 0);
+  for (size_t idx = 0; idx != heads.size(); ++idx)
+    if (bin[idx] == INVALID_PART && preferred[idx] != INVALID_PART)
+      leftover_weight[preferred[idx]] += component_below[heads[idx]];
+  std::vector<part_t> by_leftover;
+  for (part_t part = 0; part != previous_parts; ++part)
+    if (leftover_weight[part] != 0)
+      by_leftover.push_back(part);
+  std::stable_sort(by_leftover.begin(), by_leftover.end(), [&leftover_weight](part_t const lhs, part_t const rhs) {
+    return leftover_weight[lhs] > leftover_weight[rhs]; });
+  std::vector<part_t> matched(previous_parts, INVALID_PART);
+  for (part_t const part : by_leftover) {
+    size_t const cur_part = bins.firstFit(leftover_weight[part]);
+    if (cur_part != bins.size()) {
+      bins.add(cur_part, leftover_weight[part]);
+      matched[part] = cur_part;
+    }
+  }
+
+  for (size_t idx = 0; idx != heads.size(); ++idx) {
+    if (bin[idx] != INVALID_PART)
+      continue;
+    if (preferred[idx] != INVALID_PART && matched[preferred[idx]] != INVALID_PART) {
+      bin[idx] = matched[preferred[idx]];
+      continue;
     }
+    size_t const cur_part = bins.firstFit(component_below[heads[idx]]);
+    if (cur_part == bins.size())
+      bins.open();
+    bins.add(cur_part, component_below[heads[idx]]);
+    bin[idx] = cur_part;
   }
+
+  #pragma omp parallel for
+  for (jnid_t id = 0; id < jnodes.size(); ++id)
+    parts[id] = bin[component[id]];
 }
 
 void Partition::backwardPartition(JNodeTable const &jnodes, size_t const max_component,
@@ -276,136 +1135,521 @@ void Partition::randomPartition(size_t vertex_count) {
 
 
 
+/*
+ * REFINEMENT
+ */
+
+/* Label propagation on the boundary, scored by ECV(down). Every edge belongs to the part of its lower
+ * endpoint in seq, and every vertex costs one copy per extra part among the owners of its edges.
+ * Moving X only changes the owner of X's upward edges, so a move is scored exactly from the owner counts
+ * of X and of its upward neighbours. Each round scores every vertex in parallel against the state at the
+ * start of the round. It then applies the improving moves serially, best first, rechecking each one
+ * against the moves already made and against each part's max_component. The result doesn't depend on the number of threads. */
+template <typename GraphType>
+size_t Partition::refine(GraphType const &graph, std::vector<vid_t> const &seq,
+    std::vector<size_t> const &weights, double const balance_factor, int const max_rounds)
+{
+  assert(weights.size() == seq.size());
+  assert(replicas.empty()); // Moves are scored for whole vertices.
+  std::vector<jnid_t> pos(parts.size(), INVALID_JNID);
+  for (jnid_t i = 0; i != seq.size(); ++i)
+    pos[seq[i]] = i;
+
+  size_t total_weight = 0;
+  for (size_t const weight : weights)
+    total_weight += weight;
+  std::vector<size_t> max_components = maxComponents(total_weight, balance_factor);
+
+  part_t const max_part = *std::max_element(parts.cbegin(), parts.cend());
+  std::vector<size_t> part_weight(max_part + 1, 0);
+  // Parts the packing opened past num_parts may hold as much as the biggest.
+  max_components.resize(max_part + 1, *std::max_element(max_components.cbegin(), max_components.cend()));
+  for (jnid_t i = 0; i != seq.size(); ++i)
+    part_weight.at(parts.at(seq[i])) += weights[i];
+
+  // owners[X] counts the edges of X owned by each part, sorted by part; it only lists the parts in X's ECV.
+  struct Owner { part_t part; uint32_t count; };
+  std::vector< std::vector<Owner> > owners(parts.size());
+  auto owner_count = [&owners](vid_t const X, part_t const part) -> uint32_t {
+    auto itr = std::lower_bound(owners[X].cbegin(), owners[X].cend(), part,
+        [](Owner const &owner, part_t const p) { return owner.part < p; });
+    return itr != owners[X].cend() && itr->part == part ? itr->count : 0;
+  };
+  auto add_owner = [&owners](vid_t const X, part_t const part, int64_t const delta) {
+    auto itr = std::lower_bound(owners[X].begin(), owners[X].end(), part,
+        [](Owner const &owner, part_t const p) { return owner.part < p; });
+    if (itr == owners[X].end() || itr->part != part)
+      itr = owners[X].insert(itr, Owner{part, 0});
+    itr->count += delta;
+    if (itr->count == 0)
+      owners[X].erase(itr);
+  };
+
+  std::vector<vid_t> nodes;
+  for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr)
+    nodes.push_back(*nitr);
+
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for (size_t idx = 0; idx < nodes.size(); ++idx) {
+    vid_t const X = nodes[idx];
+    for (auto eitr = graph.getEdgeItr(X); !eitr.isEnd(); ++eitr) {
+      vid_t const Y = *eitr;
+      if (pos[X] != pos[Y])
+        add_owner(X, pos[X] < pos[Y] ? parts[X] : parts[Y], 1);
+    }
+  }
+
+  // The change in ECV(down) if X moves to part to; X's upward edges number up.
+  auto gain = [&](vid_t const X, part_t const to, uint32_t const up) -> int64_t {
+    part_t const from = parts[X];
+    int64_t delta = 0;
+    if (up != 0)
+      delta += (owner_count(X, to) == 0) - (owner_count(X, from) == up);
+    for (auto eitr = graph.getEdgeItr(X); !eitr.isEnd(); ++eitr) {
+      vid_t const Y = *eitr;
+      if (pos[X] < pos[Y])
+        delta += (owner_count(Y, to) == 0) - (owner_count(Y, from) == 1);
+    }
+    return delta;
+  };
+  auto up_edges = [&](vid_t const X) -> uint32_t {
+    uint32_t up = 0;
+    for (auto eitr = graph.getEdgeItr(X); !eitr.isEnd(); ++eitr)
+      up += pos[X] < pos[*eitr];
+    return up;
+  };
+
+  struct Move { int64_t gain; vid_t vid; part_t to; };
+  size_t moved = 0;
+  for (int round = 0; round != max_rounds; ++round) {
+    std::vector<Move> moves;
+
+    #pragma omp parallel
+    {
+      std::vector<Move> local_moves;
+      std::vector<part_t> candidates;
+
+      #pragma omp for schedule(dynamic, 1024) nowait
+      for (size_t idx = 0; idx < nodes.size(); ++idx) {
+        vid_t const X = nodes[idx];
+        part_t const from = parts[X];
+        size_t const X_weight = weights[pos[X]];
+
+        candidates.clear();
+        for (auto eitr = graph.getEdgeItr(X); !eitr.isEnd(); ++eitr)
+          if (parts[*eitr] != from)
+            candidates.push_back(parts[*eitr]);
+        if (candidates.empty())
+          continue;
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        uint32_t const up = up_edges(X);
+        Move best{0, X, from};
+        for (part_t const to : candidates) {
+          if (part_weight[to] + X_weight > max_components[to])
+            continue;
+          int64_t const to_gain = gain(X, to, up);
+          if (to_gain < best.gain) {
+            best.gain = to_gain;
+            best.to = to;
+          }
+        }
+        if (best.gain < 0)
+          local_moves.push_back(best);
+      }
+
+      #pragma omp critical(refine_moves)
+      moves.insert(moves.end(), local_moves.cbegin(), local_moves.cend());
+    }
+    if (moves.empty())
+      break;
+
+    std::sort(moves.begin(), moves.end(), [](Move const &lhs, Move const &rhs) {
+      return lhs.gain < rhs.gain || (lhs.gain == rhs.gain && lhs.vid < rhs.vid); });
+
+    for (Move const &move : moves) {
+      vid_t const X = move.vid;
+      part_t const from = parts[X];
+      size_t const X_weight = weights[pos[X]];
+      uint32_t const up = up_edges(X);
+      if (part_weight[move.to] + X_weight > max_components[move.to] || gain(X, move.to, up) >= 0)
+        continue;
+
+      if (up != 0) {
+        add_owner(X, from, -(int64_t)up);
+        add_owner(X, move.to, up);
+      }
+      for (auto eitr = graph.getEdgeItr(X); !eitr.isEnd(); ++eitr) {
+        vid_t const Y = *eitr;
+        if (pos[X] < pos[Y]) {
+          add_owner(Y, from, -1);
+          add_owner(Y, move.to, 1);
+        }
+      }
+      part_weight[from] -= X_weight;
+      part_weight[move.to] += X_weight;
+      parts[X] = move.to;
+      ++moved;
+    }
+  }
+  return moved;
+}
+
+
+
 /*
  * FENNEL IMPLEMENTATIONS
  */
+
+template <typename GraphType>
+size_t Partition::fennelMaxComponent(GraphType const &graph, double const balance_factor,
+    bool const edge_balanced, std::vector<size_t> const &vertex_weights) const
+{
+  size_t total_weight = edge_balanced ? 2 * graph.getEdges() : graph.getNodes();
+  if (!vertex_weights.empty()) {
+    total_weight = 0;
+    for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr)
+      total_weight += *nitr < vertex_weights.size() ? vertex_weights[*nitr] : 0;
+  }
+  return (total_weight / num_parts) * balance_factor;
+}
+
+template <typename GraphType>
+int Partition::restream(GraphType const &graph, std::vector<vid_t> const &seq, int const max_passes,
+    double const threshold, double const balance_factor, bool const edge_balanced,
+    std::vector<size_t> const &vertex_weights, bool const parallel)
+{
+  std::vector<vid_t> nodes;
+  for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr)
+    nodes.push_back(*nitr);
+
+  auto edges_cut = [&]() {
+    size_t cut = 0;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(+:cut)
+    for (size_t i = 0; i < nodes.size(); ++i)
+      for (auto X_itr = graph.getEdgeItr(nodes[i]); !X_itr.isEnd(); ++X_itr)
+        cut += nodes[i] < *X_itr && parts[nodes[i]] != parts[*X_itr];
+    return cut;
+  };
+
+  size_t const max_component = fennelMaxComponent(graph, balance_factor, edge_balanced, vertex_weights);
+  size_t cut = edges_cut();
+  int passes = 0;
+  std::vector<part_t> previous;
+  assert(max_passes >= 0);
+  while (passes < max_passes && cut != 0) {
+    previous = parts;
+    fennel(graph, seq, max_component, edge_balanced, vertex_weights, parallel);
+    ++passes;
+
+    // A pass that cuts more than the last is undone, and not counted.
+    size_t const previous_cut = cut;
+    cut = edges_cut();
+    if (previous_cut < cut) {
+      parts = std::move(previous);
+      return passes - 1;
+    }
+    if (previous_cut - cut < threshold * previous_cut) break;
+  }
+  return passes;
+}
+
+/* Vertex Fennel. A vertex only scores the parts its neighbours are in, and the part with the most room:
+ * every other part scores nothing for neighbours and costs at least as much, so it cannot win.
+ * With capacities the cheapest part need not have the most room, so every part is scored.
+ * Each part keeps its current cost, so scoring a part takes one pow() rather than two.
+ * With parallel, the stream is taken a batch at a time. The parts of each vertex's neighbours are gathered
+ * for the whole batch in parallel, as they were before the batch, and the batch is then scored and assigned
+ * in order. So a vertex does not count neighbours in its own batch, but the part sizes it sees are current:
+ * the balance limit holds, and the result does not depend on the number of threads. */
 template <typename GraphType>
 void Partition::fennel(GraphType const &graph, std::vector<vid_t> const &seq,
-    size_t const max_component, bool const edge_balanced)
+    size_t const max_component, bool const edge_balanced, std::vector<size_t> const &vertex_weights,
+    bool const parallel)
 {
   double const n = graph.getNodes();
   double const m = 2 * graph.getEdges(); // # of DIRECTED edges; getEdges() returns UNDIRECTED#.
   double const k = num_parts;
 
+  // Vertex weights are balanced like degrees, scaled by their total rather than by the edge count.
+  double total_weight = 0.0;
+  if (!vertex_weights.empty())
+    for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr)
+      total_weight += *nitr < vertex_weights.size() ? vertex_weights[*nitr] : 0;
+
   double const y = 1.5;
-  double const a = edge_balanced ?
+  double const a = !vertex_weights.empty() ?
+    n * pow(k / total_weight, y) :
+    edge_balanced ?
     n * pow(k / m, y) : // From KDD14 paper.
     m * (pow(k, y - 1.0) / pow(n, y)); // From original FENNEL paper.
 
-  std::vector<double> part_value;
-  std::vector<double> part_size(num_parts, 0.0);
+  // A part with r times the average capacity pays a's cost on its size over r, times r, so every part's
+  // marginal cost is the same when sizes are in proportion to capacities. Without capacities r is 1.
+  std::vector<double> const relative = relativeCapacities(num_parts);
 
-  //for (vid_t const X : seq) {
-  for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr) {
-    vid_t const X = *nitr;
-    double X_weight = edge_balanced ? ((double) graph.getDeg(X)) : 1.0;
+  std::vector<vid_t> nodes;
+  for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr)
+    nodes.push_back(*nitr);
 
-    part_value.assign(num_parts, 0.0);
-    for (auto X_itr = graph.getEdgeItr(X); !X_itr.isEnd(); ++X_itr) {
-      vid_t const Y = *X_itr;
-      //if (X <= Y) continue;
-      if (parts[Y] != INVALID_PART)
-        part_value[parts[Y]] += 1.0;
+  auto vertex_weight = [&](vid_t const X) -> double {
+    if (!vertex_weights.empty())
+      return X < vertex_weights.size() ? vertex_weights[X] : 0.0;
+    return edge_balanced ? ((double) graph.getDeg(X)) : 1.0;
+  };
+
+  // part_cost[p] is a * r * pow(part_size[p] / r, y), and bins finds the part with the most room.
+  std::vector<double> part_size(num_parts, 0.0);
+  std::vector<double> part_cost(num_parts, 0.0);
+  std::vector<size_t> bin_capacities(num_parts);
+  for (part_t p = 0; p != num_parts; ++p)
+    bin_capacities[p] = max_component * relative[p];
+  BinIndex bins(bin_capacities);
+  for (part_t p = 0; p != num_parts; ++p)
+    bins.open();
+  auto cost = [&](part_t const p) { part_cost[p] = a * relative[p] * pow(part_size[p] / relative[p], y); };
+
+  // Restreaming starts from the parts the last pass left.
+  for (vid_t const X : nodes) {
+    if (parts[X] == INVALID_PART) continue;
+    part_size[parts[X]] += vertex_weight(X);
+    bins.add(parts[X], vertex_weight(X));
+  }
+  for (part_t p = 0; p != num_parts; ++p)
+    cost(p);
+
+  // part_value counts X's neighbours in each part; only the parts in touched are nonzero.
+  std::vector<double> part_value(num_parts, 0.0);
+  std::vector<part_t> touched;
+
+  auto assign = [&](vid_t const X) {
+    double const X_weight = vertex_weight(X);
+    if (parts[X] != INVALID_PART) {
+      part_size[parts[X]] -= X_weight;
+      cost(parts[X]);
+      bins.remove(parts[X], X_weight);
     }
 
     part_t max_part = 0;
     double max_value = std::numeric_limits<double>::lowest();
-    for (part_t p = 0; p != num_parts; ++p) {
-      if (part_size[p] + X_weight > max_component) continue; // Hard balance limit.
+    // Ties go to the lowest part, as they would in a scan of every part.
+    auto score = [&](part_t const p) {
+      double const r = relative[p];
+      if (part_size[p] + X_weight > max_component * r) return; // Hard balance limit.
 
       //double p_cost = a * y * pow(part_size[p], y - 1.0); // From original FENNEL paper.
-      double p_cost = a * pow(part_size[p] + X_weight, y) - a * pow(part_size[p], y);
+      double p_cost = a * r * pow((part_size[p] + X_weight) / r, y) - part_cost[p];
       double p_value = part_value[p] - p_cost;
-        if (p_value > max_value) {
+      if (p_value > max_value || (p_value == max_value && p < max_part)) {
         max_part = p;
         max_value = p_value;
       }
+    };
+    for (part_t const p : touched)
+      score(p);
+    if (capacities.empty())
+      score(bins.roomiest());
+    else
+      for (part_t p = 0; p != num_parts; ++p)
+        score(p);
+    for (part_t const p : touched)
+      part_value[p] = 0.0;
+    touched.clear();
 
-      if (part_size[p] == 0.0) break; // Everything will be 0.0 after this point.
-    }
     parts[X] = max_part;
     part_size[max_part] += X_weight;
+    cost(max_part);
+    bins.add(max_part, X_weight);
+  };
+
+  if (!parallel) {
+    for (vid_t const X : nodes) {
+      for (auto X_itr = graph.getEdgeItr(X); !X_itr.isEnd(); ++X_itr) {
+        part_t const p = parts[*X_itr];
+        if (p != INVALID_PART) {
+          if (part_value[p] == 0.0)
+            touched.push_back(p);
+          part_value[p] += 1.0;
+        }
+      }
+      assign(X);
+    }
+    return;
+  }
+
+  size_t const batch_size = 16 * KILO;
+  struct Count { part_t part; uint32_t count; };
+  std::vector< std::vector<Count> > gathered(batch_size);
+  for (size_t beg = 0; beg < nodes.size(); beg += batch_size) {
+    size_t const end = std::min(nodes.size(), beg + batch_size);
+
+    #pragma omp parallel
+    {
+      std::vector<uint32_t> counts(num_parts, 0);
+      std::vector<part_t> local_touched;
+      #pragma omp for schedule(dynamic, 256)
+      for (size_t i = beg; i < end; ++i) {
+        for (auto X_itr = graph.getEdgeItr(nodes[i]); !X_itr.isEnd(); ++X_itr) {
+          part_t const p = parts[*X_itr];
+          if (p != INVALID_PART && counts[p]++ == 0)
+            local_touched.push_back(p);
+        }
+        std::vector<Count> &X_counts = gathered[i - beg];
+        X_counts.clear();
+        for (part_t const p : local_touched) {
+          X_counts.push_back(Count{p, counts[p]});
+          counts[p] = 0;
+        }
+        local_touched.clear();
+      }
+    }
+
+    for (size_t i = beg; i != end; ++i) {
+      for (Count const &count : gathered[i - beg]) {
+        touched.push_back(count.part);
+        part_value[count.part] = count.count;
+      }
+      assign(nodes[i]);
+    }
   }
 }
 
-void Partition::fennel(char const *const filename) {
-  // I tried to privilege edge-partitioned fennel by hardcoding |V| and |E|
-  // so that only one scan of the graph file would be necessary.
-  // This is obviously cheesy, but it was a prototype, and even with this
-  // advantage it was too slow to be worthwhile for our evaluation.
-  vid_t max_vid = 4036529;
-  size_t vertex_count = 3997962;
-  size_t edge_count = 34681189;
-  double balance_factor = 1.03;
+/* The parts each vertex of an edge stream is in, each vertex's kept together in one shared pool.
+ * A vertex's parts are moved to a slot twice the size at the end of the pool whenever they fill theirs,
+ * and the slots they leave are not reused. So a vertex costs eight bytes, and its replicas fewer than four
+ * part_ts each (2^j + 1 replicas have used slots of 2 + 4 + ... + 2^(j+1)), however many parts there are.
+ * Vertices are added as they are seen. */
+class ReplicaSets {
+public:
+  inline ReplicaSets() : sets(), pool() {}
+
+  // The number of vertices in at least one part, and the number of replicas over all of them.
+  inline size_t vertices() const {
+    return std::count_if(sets.cbegin(), sets.cend(), [](Set const &set) { return set.size != 0; });
+  }
+  inline size_t size() const {
+    size_t replicas = 0;
+    for (Set const &set : sets)
+      replicas += set.size;
+    return replicas;
+  }
 
-  size_t max_component = (edge_count/num_parts)*balance_factor;
-  parts.assign(edge_count + 1, INVALID_PART);
+  inline part_t const *begin(vid_t const X) const { return X < sets.size() ? pool.data() + sets[X].begin : nullptr; }
+  inline part_t const *end(vid_t const X) const { return X < sets.size() ? begin(X) + sets[X].size : nullptr; }
+
+  inline bool contains(vid_t const X, part_t const part) const { return std::find(begin(X), end(X), part) != end(X); }
+
+  // part must not already hold X.
+  inline void add(vid_t const X, part_t const part) {
+    if (X >= sets.size())
+      sets.resize(X + 1, Set{0, 0});
+    Set &set = sets[X];
+    if (set.size == 0 || (set.size >= 2 && (set.size & (set.size - 1)) == 0)) {
+      size_t const slot = set.size == 0 ? 2 : 2 * set.size;
+      if (pool.size() + slot > std::numeric_limits<uint32_t>::max()) {
+        fprintf(stderr, "ERROR: More than %u replicas for the streaming edge partitioner.\n",
+            std::numeric_limits<uint32_t>::max());
+        throw std::bad_alloc();
+      }
+      pool.resize(pool.size() + slot, INVALID_PART);
+      std::copy(pool.cbegin() + set.begin, pool.cbegin() + set.begin + set.size, pool.end() - slot);
+      set.begin = pool.size() - slot;
+    }
+    pool[set.begin + set.size++] = part;
+  }
 
-  struct xs1 {
-	  unsigned tail;
-	  unsigned head;
-	  float weight;
-  };
-  xs1 buf;
-  /*
-  std::ifstream stream(filename, std::ios::binary);
-  while (!stream.eof()) {
-    stream.read((char*)&buf, sizeof(xs1));
-    if (buf.tail > max_vid)
-      max_vid = buf.tail;
-    if (buf.head > max_vid)
-      max_vid = buf.head;
-    ++edge_count;
-  }
-  */
-
-  double const n = vertex_count;
-  double const m = 2 * edge_count; // # of DIRECTED edges; getEdges() returns UNDIRECTED#.
-  double const k = num_parts;
+private:
+  struct Set { uint32_t begin; uint32_t size; };
+  std::vector<Set> sets;
+  std::vector<part_t> pool;
+};
 
-  double const y = 1.5;
-  double const a = m * (pow(k, y - 1.0) / pow(n, y));
+/* HDRF (Petroni et al., CIKM15) with lambda = 1. Only the parts that hold an endpoint can score for
+ * replication, and among the rest the smallest part scores best, so those are the only parts scored. */
+template <typename ReaderType>
+void Partition::fennel_template(char const *const filename, double const balance_factor)
+{
+  double const lambda = 1.0;
+  double const epsilon = 1.0;
 
-  std::vector<double> part_value;
-  std::vector<double> part_size(num_parts, 0.0);
-  std::vector<bool> touches_part(num_parts * (max_vid + 1));
+  ReplicaSets placed;
+  std::vector<uint32_t> degrees;
 
-  std::ifstream stream(filename, std::ios::binary);
-  for (size_t eid = 0; !stream.eof(); ++eid) {
-    stream.read((char*)&buf, sizeof(xs1));
-    vid_t const X = buf.tail;
-    vid_t const Y = buf.head;
+  // bins only ranks the parts by size, to find the smallest; no part runs out of room.
+  std::vector<size_t> part_size(num_parts, 0);
+  BinIndex bins(std::vector<size_t>(num_parts, std::numeric_limits<int64_t>::max()));
+  for (part_t p = 0; p != num_parts; ++p)
+    bins.open();
+  size_t max_size = 0;
 
-    part_value.assign(num_parts, 0.0);
-    for (part_t p = 0; k != num_parts; ++p) {
-      if (touches_part.at(num_parts * X + p) == true)
-        part_value[p] += 1.0;
-      if (touches_part.at(num_parts * Y + p) == true)
-        part_value[p] += 1.0;
-    }
+  // part_value is the replication score of the parts in touched, and holds records which endpoints they hold.
+  std::vector<double> part_value(num_parts, 0.0);
+  std::vector<uint8_t> holds(num_parts, 0);
+  std::vector<part_t> touched;
 
-    part_t max_part = 0;
-    double max_value = std::numeric_limits<double>::lowest();
-    for (part_t p = 0; p != num_parts; ++p) {
-      if (part_size[p] + 1.0 > max_component) continue; // Hard balance limit.
+  parts.clear();
+  vid_t X,Y;
+  ReaderType reader(filename);
+  while (reader.read(X,Y)) {
+    if (std::max(X,Y) >= degrees.size())
+      degrees.resize(std::max(X,Y) + 1, 0);
+    ++degrees[X];
+    if (Y != X) ++degrees[Y];
+    double const theta_X = (double) degrees[X] / (degrees[X] + degrees[Y]);
+
+    // An endpoint counts for more in a part the lower its degree, so that hubs are the ones replicated.
+    auto gather = [&](vid_t const Z, uint8_t const bit, double const g) {
+      for (part_t const *p = placed.begin(Z); p != placed.end(Z); ++p) {
+        if (holds[*p] == 0) touched.push_back(*p);
+        holds[*p] |= bit;
+        part_value[*p] += g;
+      }
+    };
+    gather(X, 1, 2.0 - theta_X);
+    if (Y != X) gather(Y, 2, 1.0 + theta_X);
 
-      double p_cost = a * pow(part_size[p] + 1.0, y) - a * pow(part_size[p], y);
-      double p_value = part_value[p] - p_cost;
-        if (p_value > max_value) {
+    part_t const min_part = bins.roomiest();
+    double const min_size = part_size[min_part];
+    double const limit = std::max(balance_factor * (parts.size() + 1) / num_parts, min_size + 1.0);
+
+    part_t max_part = min_part;
+    double max_value = std::numeric_limits<double>::lowest();
+    auto score = [&](part_t const p) {
+      if (part_size[p] + 1.0 > limit) return; // Hard balance limit.
+      double const p_value = part_value[p] + lambda * (max_size - part_size[p]) / (epsilon + max_size - min_size);
+      if (p_value > max_value || (p_value == max_value && p < max_part)) {
         max_part = p;
         max_value = p_value;
       }
-
-      if (part_size[p] == 0.0) break; // Everything will be 0.0 after this point.
+    };
+    for (part_t const p : touched)
+      score(p);
+    score(min_part);
+
+    if ((holds[max_part] & 1) == 0) placed.add(X, max_part);
+    if ((holds[max_part] & 2) == 0 && Y != X) placed.add(Y, max_part);
+    for (part_t const p : touched) {
+      part_value[p] = 0.0;
+      holds[p] = 0;
     }
+    touched.clear();
 
-    parts[eid] = max_part;
-    part_size[max_part] += 1.0;
-    touches_part.at(num_parts * X + max_part) = true;
-    touches_part.at(num_parts * X + max_part) = true;
+    parts.push_back(max_part);
+    ++part_size[max_part];
+    max_size = std::max(max_size, part_size[max_part]);
+    bins.add(max_part, 1);
   }
 }
 
+void Partition::fennel(char const *const filename, double const balance_factor)
+{
+  if (strcmp(".dat", filename + strlen(filename) - 4) == 0)
+    fennel_template<XS1Reader>(filename, balance_factor);
+  else
+    fennel_template<SNAPReader>(filename, balance_factor);
+}
+
 
 
 /*
@@ -467,9 +1711,9 @@ void Partition::evaluate(GraphType const &graph) const {
   //XXX Remember graph.getEdges includes self-edges for some graphs.
   printf("edges cut: %zu (%f%%)\n", edges_cut, (double) edges_cut / graph.getEdges());
   printf("Vcom. vol: %zu (%f%%)\n", Vcom_vol, (double) Vcom_vol / graph.getEdges());
-  printf("  balance: %zu (%f%%)\n", max_vertex_bal, (double) max_vertex_bal / (graph.getNodes() / num_parts));
+  printf("  balance: %zu (%f%%)\n", max_vertex_bal, imbalance(vertex_balance, graph.getNodes()));
   printf("ECV(hash): %zu (%f%%)\n", ECV_hash, (double) ECV_hash / graph.getEdges());
-  printf("  balance: %zu (%f%%)\n", max_hash_bal, (double) max_hash_bal / (graph.getEdges() / num_parts));
+  printf("  balance: %zu (%f%%)\n", max_hash_bal, imbalance(hash_balance, graph.getEdges()));
 }
 
 template <typename GraphType>
@@ -483,7 +1727,7 @@ void Partition::evaluate(GraphType const &graph, std::vector<vid_t> const &seq)
   size_t ECV_down = 0;
   size_t ECV_up = 0;
 
-  part_t max_part = *std::max_element(parts.cbegin(), parts.cend()) + 1;
+  part_t max_part = partCount();
   std::vector<size_t> down_balance(max_part, 0);
   std::vector<size_t> up_balance(max_part, 0);
 
@@ -502,9 +1746,9 @@ void Partition::evaluate(GraphType const &graph, std::vector<vid_t> const &seq)
       part_t const Y_part = parts.at(Y);
       assert(Y_part != INVALID_PART);
 
-      ECV_down_nbrs.insert((X_pos < Y_pos) ? X_part : Y_part);
+      ECV_down_nbrs.insert((X_pos < Y_pos) ? ownerPart(X, Y) : ownerPart(Y, X));
       ECV_up_nbrs.insert((X_pos > Y_pos) ? X_part : Y_part);
-      if (X_pos < Y_pos) down_balance.at(X_part) += 1;
+      if (X_pos < Y_pos) down_balance.at(ownerPart(X, Y)) += 1;
       if (X_pos > Y_pos) up_balance.at(X_part) += 1;
     }
     ECV_down += ECV_down_nbrs.size() - 1;
@@ -515,13 +1759,45 @@ void Partition::evaluate(GraphType const &graph, std::vector<vid_t> const &seq)
   size_t max_up_bal = *std::max_element(up_balance.cbegin(), up_balance.cend());
 
   printf("ECV(down): %zu (%f%%)\n", ECV_down, (double) ECV_down / graph.getEdges());
-  printf("  balance: %zu (%f%%)\n", max_down_bal, (double) max_down_bal / (graph.getEdges() / num_parts));
+  printf("  balance: %zu (%f%%)\n", max_down_bal, imbalance(down_balance, graph.getEdges()));
   printf("ECV(up)  : %zu (%f%%)\n", ECV_up, (double) ECV_up / graph.getEdges());
-  printf("  balance: %zu (%f%%)\n", max_up_bal, (double) max_up_bal / (graph.getEdges() / num_parts));
+  printf("  balance: %zu (%f%%)\n", max_up_bal, imbalance(up_balance, graph.getEdges()));
 }
 
 
 
+template <typename ReaderType>
+void Partition::evaluateEdges_template(char const *const filename) const
+{
+  ReplicaSets placed;
+  std::vector<size_t> edge_balance(partCount(), 0);
+
+  size_t eid = 0;
+  vid_t X,Y;
+  ReaderType reader(filename);
+  while (reader.read(X,Y)) {
+    part_t const part = parts.at(eid++);
+    ++edge_balance.at(part);
+    if (!placed.contains(X, part)) placed.add(X, part);
+    if (!placed.contains(Y, part)) placed.add(Y, part);
+  }
+  assert(eid == parts.size());
+
+  size_t const vertices = placed.vertices();
+  size_t const max_edge_bal = *std::max_element(edge_balance.cbegin(), edge_balance.cend());
+
+  printf("replicas : %zu (%f per vertex)\n", placed.size(), (double) placed.size() / vertices);
+  printf("  balance: %zu (%f%%)\n", max_edge_bal, imbalance(edge_balance, eid));
+}
+
+void Partition::evaluateEdges(char const *const filename) const
+{
+  if (strcmp(".dat", filename + strlen(filename) - 4) == 0)
+    evaluateEdges_template<XS1Reader>(filename);
+  else
+    evaluateEdges_template<SNAPReader>(filename);
+}
+
 /*
  * INPUT/OUTPUT
  */
@@ -594,16 +1870,7 @@ void Partition::writePartitionedGraph(
   for (jnid_t i = 0; i != seq.size(); ++i)
     pos[seq[i]] = i;
 
-  part_t const max_part = *std::max_element(parts.cbegin(), parts.cend());
-  assert(max_part < 10000);
-
-  std::vector<WriterType*> writers;
-  for (part_t p = 0; p != max_part + 1; ++p) {
-    char *output_filename = (char*)malloc(strlen(output_prefix) + 5);
-    sprintf(output_filename, "%s%04d", output_prefix, p);
-    writers.emplace_back(new WriterType(output_filename));
-    free(output_filename);
-  }
+  PartitionWriter<WriterType> writers(output_prefix, partCount());
 
   for (auto nitr = graph.getNodeItr(); !nitr.isEnd(); ++nitr) {
     vid_t const X = *nitr;
@@ -620,13 +1887,10 @@ void Partition::writePartitionedGraph(
       part_t const Y_part = parts.at(Y);
       assert(Y_part != INVALID_PART);
 
-      part_t edge_part = X_pos < Y_pos ? X_part : Y_part;
-      writers.at(edge_part)->write(X,Y);
+      part_t edge_part = X_pos < Y_pos ? ownerPart(X, Y) : ownerPart(Y, X);
+      writers.write(edge_part, X, Y);
     }
   }
-
-  for (WriterType *writer : writers)
-    delete writer;
 }
 
 template <typename ReaderType, typename WriterType>
@@ -638,16 +1902,7 @@ void Partition::writePartitionedGraph_template(
   for (jnid_t i = 0; i != seq.size(); ++i)
     pos[seq[i]] = i;
 
-  part_t const max_part = *std::max_element(parts.cbegin(), parts.cend());
-  assert(max_part < 10000);
-
-  std::vector<WriterType*> writers;
-  for (part_t p = 0; p != max_part + 1; ++p) {
-    char *output_filename = (char*)malloc(strlen(output_prefix) + 5);
-    sprintf(output_filename, "%s%04d", output_prefix, p);
-    writers.emplace_back(new WriterType(output_filename));
-    free(output_filename);
-  }
+  PartitionWriter<WriterType> writers(output_prefix, partCount());
 
   vid_t X,Y;
   ReaderType reader(input_filename);
@@ -661,12 +1916,9 @@ void Partition::writePartitionedGraph_template(
     assert(X_part != INVALID_PART);
     assert(Y_part != INVALID_PART);
 
-    part_t edge_part = X_pos < Y_pos ? X_part : Y_part;
-    writers.at(edge_part)->write(X,Y);
+    part_t edge_part = X_pos < Y_pos ? ownerPart(X, Y) : ownerPart(Y, X);
+    writers.write(edge_part, X, Y);
   }
-
-  for (WriterType *writer : writers)
-    delete writer;
 }
 
 template <typename WriterType>
@@ -680,3 +1932,113 @@ void Partition::writePartitionedGraph(
     writePartitionedGraph_template<SNAPReader,WriterType>(input_filename, seq, output_prefix);
 }
 
+
+template <typename ReaderType>
+Partition::MirrorTable Partition::mirrorTable_template(char const *const input_filename,
+    std::vector<vid_t> const &seq) const
+{
+  std::vector<jnid_t> pos(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_JNID);
+  for (jnid_t i = 0; i != seq.size(); ++i)
+    pos[seq[i]] = i;
+
+  // An endpoint of an edge owned outside the endpoint's own part is mirrored in the owner's part.
+  struct Mirror { vid_t vid; part_t part; };
+  std::vector<Mirror> found;
+  std::vector< std::pair<vid_t, vid_t> > block;
+  size_t const block_edges = 4 * MEGA;
+
+  vid_t X,Y;
+  ReaderType reader(input_filename);
+  for (bool more = true; more; ) {
+    block.clear();
+    while (block.size() != block_edges && (more = reader.read(X,Y)))
+      block.emplace_back(X, Y);
+
+    #pragma omp parallel
+    {
+      std::vector<Mirror> local_found;
+      #pragma omp for schedule(static) nowait
+      for (size_t i = 0; i < block.size(); ++i) {
+        bool const X_owns = pos.at(block[i].first) < pos.at(block[i].second);
+        vid_t const owner = X_owns ? block[i].first : block[i].second;
+        vid_t const other = X_owns ? block[i].second : block[i].first;
+        part_t const edge_part = ownerPart(owner, other);
+        assert(parts.at(owner) != INVALID_PART && parts.at(other) != INVALID_PART);
+
+        if (edge_part != parts[owner])
+          local_found.push_back(Mirror{owner, edge_part});
+        if (edge_part != parts[other])
+          local_found.push_back(Mirror{other, edge_part});
+      }
+      #pragma omp critical(mirror_table)
+      found.insert(found.end(), local_found.cbegin(), local_found.cend());
+    }
+  }
+
+  __gnu_parallel::sort(found.begin(), found.end(), [](Mirror const &lhs, Mirror const &rhs) {
+    return lhs.vid < rhs.vid || (lhs.vid == rhs.vid && lhs.part < rhs.part); });
+  found.erase(std::unique(found.begin(), found.end(), [](Mirror const &lhs, Mirror const &rhs) {
+    return lhs.vid == rhs.vid && lhs.part == rhs.part; }), found.end());
+
+  MirrorTable table;
+  table.offsets.assign(parts.size() + 1, 0);
+  table.mirrors.resize(found.size());
+  for (size_t i = 0; i != found.size(); ++i) {
+    ++table.offsets[found[i].vid + 1];
+    table.mirrors[i] = found[i].part;
+  }
+  for (vid_t X = 0; X != parts.size(); ++X)
+    table.offsets[X + 1] += table.offsets[X];
+  return table;
+}
+
+Partition::MirrorTable Partition::mirrorTable(char const *const input_filename,
+    std::vector<vid_t> const &seq) const
+{
+  if (strcmp(".dat", input_filename + strlen(input_filename) - 4) == 0)
+    return mirrorTable_template<XS1Reader>(input_filename, seq);
+  else
+    return mirrorTable_template<SNAPReader>(input_filename, seq);
+}
+
+void Partition::writeMirrorTables(char const *const input_filename, std::vector<vid_t> const &seq,
+    char const *const output_prefix) const
+{
+  MirrorTable const table = mirrorTable(input_filename, seq);
+
+  // Bucket the vertices by the parts that hold them, in vid order.
+  part_t const part_count = partCount();
+  std::vector<size_t> held(part_count + 1, 0);
+  for (vid_t X = 0; X != parts.size(); ++X) {
+    if (parts[X] == INVALID_PART) continue;
+    ++held[parts[X] + 1];
+    for (size_t i = table.offsets[X]; i != table.offsets[X + 1]; ++i)
+      ++held[table.mirrors[i] + 1];
+  }
+  for (part_t part = 0; part != part_count; ++part)
+    held[part + 1] += held[part];
+  std::vector<vid_t> vertices(held[part_count]);
+  std::vector<size_t> next(held.cbegin(), held.cend() - 1);
+  for (vid_t X = 0; X != parts.size(); ++X) {
+    if (parts[X] == INVALID_PART) continue;
+    vertices[next[parts[X]]++] = X;
+    for (size_t i = table.offsets[X]; i != table.offsets[X + 1]; ++i)
+      vertices[next[table.mirrors[i]]++] = X;
+  }
+
+  // One file at a time, so the number of parts is not limited by the number of open files.
+  std::string const prefix(output_prefix);
+  std::vector<char> filename(prefix.size() + 32);
+  for (part_t part = 0; part != part_count; ++part) {
+    sprintf(filename.data(), "%s%04zu.mirrors", prefix.c_str(), (size_t) part);
+    std::ofstream stream(filename.data());
+    for (size_t i = held[part]; i != held[part + 1]; ++i) {
+      vid_t const X = vertices[i];
+      stream << X << ' ' << parts[X];
+      if (parts[X] == part)
+        for (size_t j = table.offsets[X]; j != table.offsets[X + 1]; ++j)
+          stream << ' ' << table.mirrors[j];
+      stream << '\n';
+    }
+  }
+}
@@ -38,22 +38,107 @@
 #include "defs.h"
 #include "graph_wrapper.h"
 #include "jnode.h"
+#include "partition_index.h"
 #include "readerwriter.h"
-
-typedef short part_t;
-#define INVALID_PART (part_t)-1
+#include "weights.h"
 
 class Partition {
 public:
   std::vector<part_t> parts;
   part_t num_parts;
 
-  Partition(std::vector<jnid_t> const &seq, JNodeTable &jnodes, part_t np,
-      double balance_factor = 1.03, bool vtx_weight = false, bool pst_weight = true, bool pre_weight = false);
-
-  inline Partition() : parts(), num_parts() {}
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, part_t np,
+      double balance_factor = 1.03, bool vtx_weight = false, bool pst_weight = true, bool pre_weight = false,
+      bool parallel = false);
+
+  static std::vector<size_t> jnodeWeights(JNodeTable const &jnodes,
+      bool vtx_weight = false, bool pst_weight = true, bool pre_weight = false);
+
+  /* A sweep partitions one tree many times, so it works out once what does not depend on the part count:
+   * the jnode weights, their total, and each jnode's kids ordered heaviest subtree first, then by jnid.
+   * Cutting a component takes its kids heaviest first, which is this order until a kid's own subtree is cut.
+   * The tree is never modified, so the partitions of a sweep may be computed concurrently. */
+  struct Sweep {
+    std::vector<size_t> weights;
+    size_t total_weight;
+    std::vector<size_t> kid_offsets;
+    std::vector<jnid_t> kids;
+
+    Sweep(JNodeTable const &jnodes, std::vector<size_t> jnode_weights);
+
+    inline jnid_t const *kidsBegin(jnid_t const id) const { return kids.data() + kid_offsets[id]; }
+    inline jnid_t const *kidsEnd(jnid_t const id) const { return kids.data() + kid_offsets[id + 1]; }
+  };
+
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+      part_t np, double balance_factor = 1.03, bool parallel = false, bool split_hubs = false);
+
+  /* A hierarchical partition splits the tree into fanouts[0] parts, then splits each of those into
+   * fanouts[1] parts, and so on, with balance_factors[level] at each level. Each level only cuts within
+   * the parts of the level above, so the first level (e.g. the network) carries the cheapest cut.
+   * Part ids are mixed-radix: the id at level L is the digit in base radices[L], most significant first.
+   * A radix is the level's fanout unless some part needed more bins than that. */
+  std::vector<part_t> radices;
+
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+      std::vector<part_t> const &fanouts, std::vector<double> const &balance_factors);
+
+  /* Parts need not be the same size: capacities[P] is part P's relative capacity (e.g. its machine's speed),
+   * and part P may hold balance_factor times capacities[P] / sum(capacities) of the total weight.
+   * Empty capacities mean equal parts. A packing that runs out of parts opens more, as big as the biggest. */
+  std::vector<double> capacities;
+
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+      std::vector<double> const &caps, double balance_factor = 1.03, bool parallel = false,
+      bool split_hubs = false);
+
+  /* Each of the first count parts' capacity relative to the average part's; all 1.0 without capacities. */
+  std::vector<double> relativeCapacities(size_t const count) const;
+
+  /* The most weight each of the num_parts parts may hold, given the total and the balance_factor. */
+  std::vector<size_t> maxComponents(size_t const total_weight, double const balance_factor) const;
+
+  /* A jnode that outweighs a part on its own, like a hub's post-edges at high k, cannot be packed whole.
+   * Without split_hubs it gets a part of its own, past the balance factor. With split_hubs it is cut instead:
+   * its weight is dealt out in near-equal pieces that each fit a part, and the vertex is replicated in the part
+   * of every piece. replicas lists the pieces of the split vertices by vid, then part; parts[X] is the part of
+   * the piece that stayed in the tree. Each edge that X owns under ECV(down) goes to one of its pieces,
+   * picked by hashing the other endpoint in proportion to the pieces' weights (see ownerPart). */
+  struct Replica {
+    vid_t vid;
+    part_t part;
+    size_t weight;
+  };
+  std::vector<Replica> replicas;
+
+  /* The part of edge (X,Y), where X owns the edge under ECV(down): parts[X] unless X was split. */
+  part_t ownerPart(vid_t const X, vid_t const Y) const;
+
+  /* One more than the largest part id in use, counting the parts that only hold pieces of split vertices. */
+  part_t partCount() const;
+
+  /* A multi-constraint partition balances several weights at once: weights[d] holds every jnode's weight
+   * in dimension d, and no part may exceed balance_factor times its share of any dimension. */
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes,
+      std::vector< std::vector<size_t> > const &weights, part_t np, double balance_factor = 1.03);
+
+  /* A repartition of a changed graph's tree that moves as little as it can from previous,
+   * which is vid-indexed and need not come from the same sequence. See migratingForwardPartition. */
+  Partition(std::vector<jnid_t> const &seq, JNodeTable const &jnodes, Sweep const &sweep,
+      Partition const &previous, part_t np, double balance_factor = 1.03);
+
+  inline Partition() : parts(), num_parts(), radices(), capacities(), replicas() {}
+
+  inline Partition(PartitionIndex const &index) :
+    parts(index.size()), num_parts(index.numParts()), radices(), capacities(), replicas()
+  {
+    #pragma omp parallel for
+    for (vid_t X = 0; X < parts.size(); ++X)
+      parts[X] = index.part(X);
+  }
 
-  inline Partition(std::vector<jnid_t> const &seq, char const *filename) : parts(), num_parts()
+  inline Partition(std::vector<jnid_t> const &seq, char const *filename) :
+    parts(), num_parts(), radices(), capacities(), replicas()
   {
     readPartition(filename);
     num_parts = *std::max_element(parts.cbegin(), parts.cend());
@@ -65,20 +150,37 @@ public:
     parts = std::move(tmp);
   }
 
+  /* Fennel balances vertices, or degrees if edge_balanced, unless it is given vid-indexed vertex_weights
+   * (see weights.h), which it balances instead. caps, if given, must have np entries.
+   * parallel gathers neighbours' parts in parallel, a batch of the stream at a time. */
   template <typename GraphType>
   inline Partition(GraphType const &graph, std::vector<vid_t> const &seq, part_t np, 
-      double balance_factor = 1.03, bool edge_balanced = true) :
-    parts(graph.getMaxVid() + 1, INVALID_PART), num_parts(np)
+      double balance_factor = 1.03, bool edge_balanced = true,
+      std::vector<size_t> const &vertex_weights = std::vector<size_t>(),
+      std::vector<double> const &caps = std::vector<double>(), bool parallel = false) :
+    parts(graph.getMaxVid() + 1, INVALID_PART), num_parts(np), radices(), capacities(caps), replicas()
   {
-    size_t total_weight = edge_balanced ? 2 * graph.getEdges() : graph.getNodes();
-    size_t max_component = (total_weight / num_parts) * balance_factor;
-    fennel(graph, seq, max_component, edge_balanced);
+    assert(capacities.empty() || capacities.size() == (size_t) num_parts);
+    fennel(graph, seq, fennelMaxComponent(graph, balance_factor, edge_balanced, vertex_weights),
+        edge_balanced, vertex_weights, parallel);
   }
 
-  inline Partition(char const *filename, part_t np) :
-    parts(), num_parts(np)
+  /* Restreaming Fennel streams the graph again, up to max_passes times, with every vertex starting in
+   * the part it was given last: each one leaves its part and is placed again against its neighbours'
+   * latest parts. It stops early once a pass cuts fewer than threshold (a fraction) of the edges the
+   * previous pass left cut, or cuts nothing. A pass that cuts more edges than the one before is undone.
+   * The other arguments must be the ones the partition was made with. It returns the number of passes kept. */
+  template <typename GraphType>
+  int restream(GraphType const &graph, std::vector<vid_t> const &seq, int max_passes, double threshold,
+      double balance_factor = 1.03, bool edge_balanced = true,
+      std::vector<size_t> const &vertex_weights = std::vector<size_t>(), bool parallel = false);
+
+  /* Edge Fennel partitions the edges of a .dat or .net file in one pass over it; parts is indexed by
+   * the edge's position in the file. See fennel(filename) below. */
+  inline Partition(char const *filename, part_t np, double balance_factor = 1.03) :
+    parts(), num_parts(np), radices(), capacities(), replicas()
   {
-    fennel(filename);
+    fennel(filename, balance_factor);
   }
 
   void mpi_sync();
@@ -90,8 +192,22 @@ public:
    * forwardPartition is the best method and the method described in our paper;
    * the others are all experiments. */
 
-  void forwardPartition(JNodeTable &jnodes, size_t const max_component,
-      bool const vtx_weight, bool const pst_weight, bool const pre_weight);
+  /* max_components[P] is the most part P may hold; parts past the end may hold the most of any. */
+  void forwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+      std::vector<size_t> const &max_components, bool const split_hubs = false);
+
+  size_t forwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+      std::vector<part_t> const &groups, std::vector< std::vector<size_t> > const &max_components,
+      bool const split_hubs = false);
+
+  void multiForwardPartition(JNodeTable const &jnodes, std::vector< std::vector<size_t> > const &weights,
+      std::vector<size_t> const &max_components);
+
+  void parallelForwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+      std::vector<size_t> const &max_components, bool const split_hubs = false);
+
+  void migratingForwardPartition(JNodeTable const &jnodes, Sweep const &sweep,
+      size_t const max_component, std::vector<part_t> const &previous);
 
   void backwardPartition(JNodeTable const &jnodes, size_t const max_component,
       bool const vtx_weight, bool const pst_weight, bool const pre_weight);
@@ -109,6 +225,16 @@ public:
 
 
 
+  /* REFINEMENT
+   * refine improves a tree partition by moving boundary vertices where that lowers ECV(down).
+   * weights and balance_factor must be the ones the partition was made with, so that no part grows
+   * past the partition's max_component. It returns the number of vertices moved. */
+  template <typename GraphType>
+  size_t refine(GraphType const &graph, std::vector<vid_t> const &seq,
+      std::vector<size_t> const &weights, double balance_factor = 1.03, int max_rounds = 4);
+
+
+
   /* The remaining partitioning algorithms are NOT for JNodeTables.
    * readPartition does what it says on the can;
    * the other two are competing implementations of Fennel. */
@@ -122,11 +248,25 @@ public:
       parts.push_back(p);
   }
 
+  // Fennel's max_component: the total weight it balances over num_parts, times balance_factor.
+  template <typename GraphType>
+  size_t fennelMaxComponent(GraphType const &graph, double const balance_factor, bool const edge_balanced,
+      std::vector<size_t> const &vertex_weights) const;
+
+  /* Vertices that already have a part leave it before they are placed again, as restream needs. */
   template <typename GraphType>
   void fennel(GraphType const &graph, std::vector<vid_t> const &seq,
-      size_t const max_component, bool const edge_balanced);
+      size_t const max_component, bool const edge_balanced,
+      std::vector<size_t> const &vertex_weights = std::vector<size_t>(), bool parallel = false);
+
+  /* The streaming edge partitioner scores each edge's parts as HDRF does: a part gains for each endpoint
+   * it already holds, more for the endpoint of lower degree so far, and for being small against the others.
+   * A part may not pass balance_factor times the average of the edges read so far. Besides parts, it keeps
+   * only each vertex's degree so far and the parts it is in, so it needs no vertex or edge counts up front. */
+  template <typename ReaderType>
+  void fennel_template(char const *const filename, double const balance_factor);
 
-  void fennel(char const *const filename);
+  void fennel(char const *const filename, double const balance_factor = 1.03);
 
 
 
@@ -134,19 +274,50 @@ public:
 
   inline void print() const
   {
-    part_t max_part = *std::max_element(parts.cbegin(), parts.cend()) + 1;
+    part_t max_part = partCount();
     size_t first_part = std::count(parts.cbegin(), parts.cend(), 0);
     size_t second_part = std::count(parts.cbegin(), parts.cend(), 1);
 
     printf("Actually created %d partitions.\n", max_part);
+    if (!radices.empty()) {
+      printf("Part ids are digits in bases");
+      for (part_t const radix : radices)
+        printf(" %d", radix);
+      printf(".\n");
+    }
     printf("First two partition sizes: %zu and %zu\n", first_part, second_part);
+    if (!replicas.empty()) {
+      size_t hubs = 0;
+      for (size_t i = 0; i != replicas.size(); ++i)
+        hubs += i == 0 || replicas[i].vid != replicas[i - 1].vid;
+      printf("Split %zu hubs into %zu replicas.\n", hubs, replicas.size());
+    }
   }
 
+  /* The heaviest part's weight against the average part's, for seq-indexed weights.
+   * With capacities, each part is measured against its own share instead. */
+  double balance(std::vector<vid_t> const &seq, std::vector<size_t> const &weights) const;
+
+  /* The same for weights already summed per part: part_weight[P] of total in part P. */
+  double imbalance(std::vector<size_t> const &part_weight, size_t const total) const;
+
+  /* The weight of the vertices that changed part since previous, i.e. the edges moved under ECV(down)
+   * if weights are pst weights. Vertices that previous did not have are not counted. */
+  size_t migration(std::vector<vid_t> const &seq, std::vector<size_t> const &weights,
+      Partition const &previous) const;
+
   template <typename GraphType>
   void evaluate(GraphType const &graph) const; 
 
   template <typename GraphType>
   void evaluate(GraphType const &graph, std::vector<vid_t> const &seq) const;
+
+  /* For an edge partition from the streaming edge partitioner, rereads filename to print the replication
+   * factor, the parts a vertex is in on average, and the edge balance. */
+  template <typename ReaderType>
+  void evaluateEdges_template(char const *const filename) const;
+
+  void evaluateEdges(char const *const filename) const;
   
 
 
@@ -169,6 +340,12 @@ public:
       char const *const input_filename, std::vector<vid_t> const &seq,
       char const *const output_filename) const;
 
+  /* This write-out method writes a PartitionIndex, which answers part and edge queries without the graph.
+   * seq must be the sequence the partition was made with. */
+  inline void writeIndex(std::vector<vid_t> const &seq, char const *const index_filename) const {
+    PartitionIndex::write(index_filename, parts, seq);
+  }
+
   /* This write-out method simply writes each partition to a separate file.
    * It also isomorphs the graph according to seq, which is almost always desirable.
    */
@@ -186,6 +363,26 @@ public:
   void writePartitionedGraph(
       char const *const input_filename, std::vector<vid_t> const &seq,
       char const *const output_prefix) const;
+
+  /* Under ECV(down) a vertex is replicated in every part that owns one of its edges, and its master is parts[X].
+   * A MirrorTable lists each vid's mirrors, the parts other than its master that replicate it, in part order:
+   * vid X's are mirrors[offsets[X]] up to mirrors[offsets[X + 1]]. It is made in one pass over the edges,
+   * a block at a time, each block in parallel. */
+  struct MirrorTable {
+    std::vector<size_t> offsets;
+    std::vector<part_t> mirrors;
+  };
+
+  template <typename ReaderType>
+  MirrorTable mirrorTable_template(char const *const input_filename, std::vector<vid_t> const &seq) const;
+
+  MirrorTable mirrorTable(char const *const input_filename, std::vector<vid_t> const &seq) const;
+
+  /* This write-out method writes each part's vertices to $PREFIX%04d.mirrors, alongside its edges, so that a
+   * vertex-cut engine need not work out replication itself. Each line is a vertex the part holds, in vid order,
+   * and its master's part; the master's own line goes on to list the vertex's mirrors. */
+  void writeMirrorTables(char const *const input_filename, std::vector<vid_t> const &seq,
+      char const *const output_prefix) const;
 };
 
 #include "partition.cpp"
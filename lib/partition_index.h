@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2015
+ *      The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <new>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "defs.h"
+
+/* PARTITION INDEX FILE FORMAT
+ * A partition index is an IndexHeader followed by one IndexEntry per vid, from 0 to vid_count - 1.
+ * An entry holds the vertex's part and its position in the sequence the partition was made with;
+ * under ECV(down), an edge belongs to the part of whichever endpoint comes first in the sequence.
+ * Vertices not in the sequence have INVALID_VID and INVALID_PART. The checksum covers the entries.
+ *
+ * Packing both into one entry means a vertex lookup touches one cache line and an edge lookup two,
+ * so an index can serve queries straight from the page cache without the graph or the text partition. */
+#define INDEX_MAGIC 0x5844495045454853ULL // "SHEEPIDX"
+#define INDEX_VERSION 1
+
+struct IndexEntry {
+  vid_t pos;
+  part_t part;
+};
+
+struct IndexHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t vid_width;
+  uint32_t part_width;
+  uint32_t entry_width;
+  uint64_t vid_count;
+  uint64_t num_parts;
+  uint64_t checksum;
+
+  inline IndexHeader() :
+    magic(INDEX_MAGIC), version(INDEX_VERSION), vid_width(sizeof(vid_t)), part_width(sizeof(part_t)),
+    entry_width(sizeof(IndexEntry)), vid_count(0), num_parts(0), checksum(0) {}
+};
+
+class PartitionIndex {
+private:
+  char *map;
+  size_t map_bytes;
+  IndexHeader const *header;
+  IndexEntry const *entries;
+
+  // Batches at least this long are split across threads; shorter ones are not worth waking them.
+  static size_t const PARALLEL_BATCH = 64 * KILO;
+  // How many lookups ahead a batch prefetches; enough to cover a miss to DRAM.
+  static size_t const PREFETCH_DISTANCE = 16;
+
+  inline IndexEntry entry(vid_t const X) const {
+    static IndexEntry const missing = {INVALID_VID, INVALID_PART};
+    return X < header->vid_count ? entries[X] : missing;
+  }
+
+  inline void prefetch(vid_t const X) const {
+    if (X < header->vid_count)
+      __builtin_prefetch(entries + X);
+  }
+
+public:
+  /* Writes the index of a vid-indexed partition made with seq. */
+  static void write(char const *const filename, std::vector<part_t> const &parts, std::vector<vid_t> const &seq) {
+    IndexHeader header;
+    header.vid_count = parts.size();
+
+    // Value-initialized, so the padding of every entry is zero and the checksum is deterministic.
+    std::vector<IndexEntry> table(parts.size(), IndexEntry());
+    #pragma omp parallel for
+    for (size_t X = 0; X < parts.size(); ++X) {
+      table[X].pos = INVALID_VID;
+      table[X].part = parts[X];
+    }
+    #pragma omp parallel for
+    for (size_t i = 0; i < seq.size(); ++i)
+      table[seq[i]].pos = i;
+
+    part_t max_part = INVALID_PART;
+    for (part_t const part : parts)
+      max_part = std::max(max_part, part);
+    header.num_parts = max_part + 1;
+    header.checksum = checksum((char*)table.data(), sizeof(IndexEntry) * table.size(), 0);
+
+    std::ofstream stream(filename, std::ios::binary | std::ios::trunc);
+    stream.write((char*)&header, sizeof(IndexHeader));
+    stream.write((char*)table.data(), sizeof(IndexEntry) * table.size());
+    if (!stream) {
+      fprintf(stderr, "ERROR: could not write %s.\n", filename);
+      throw std::bad_alloc();
+    }
+  }
+
+  /* Indexes are mapped read-only and shared, so every process serving one index shares its pages.
+   * verify checks the checksum, which reads the whole index once. */
+  inline PartitionIndex(char const *const filename, bool const verify = true) :
+    map(nullptr), map_bytes(0), header(nullptr), entries(nullptr)
+  {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+      throw std::bad_alloc();
+
+    struct stat buf;
+    if (fstat(fd, &buf) == -1 || (size_t) buf.st_size < sizeof(IndexHeader)) {
+      close(fd);
+      fprintf(stderr, "ERROR: %s is not a partition index.\n", filename);
+      throw std::bad_alloc();
+    }
+
+    map_bytes = buf.st_size;
+    map = (char*)mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      throw std::bad_alloc();
+
+    IndexHeader const expected;
+    header = (IndexHeader const*)map;
+    entries = (IndexEntry const*)(map + sizeof(IndexHeader));
+    char const *error =
+      header->magic != INDEX_MAGIC ? "is not a partition index" :
+      header->version != INDEX_VERSION ? "has an unsupported version" :
+      header->vid_width != expected.vid_width || header->part_width != expected.part_width ||
+        header->entry_width != expected.entry_width ?
+        "was written with different vid_t or part_t widths" :
+      sizeof(IndexHeader) + sizeof(IndexEntry) * header->vid_count != map_bytes ? "is truncated" :
+      verify && header->checksum != checksum((char const*)entries, map_bytes - sizeof(IndexHeader), 0) ?
+        "fails its checksum" :
+      nullptr;
+    if (error != nullptr) {
+      munmap(map, map_bytes);
+      fprintf(stderr, "ERROR: %s %s.\n", filename, error);
+      throw std::bad_alloc();
+    }
+  }
+
+  PartitionIndex(PartitionIndex const &) = delete;
+  PartitionIndex &operator=(PartitionIndex const &) = delete;
+
+  inline ~PartitionIndex() { munmap(map, map_bytes); }
+
+  /* One past the largest indexed vid, and one past the largest part. */
+  inline size_t size() const { return header->vid_count; }
+  inline part_t numParts() const { return header->num_parts; }
+
+  /* LOOKUPS
+   * Unknown vertices, and edges between two of them, are in INVALID_PART. */
+  inline part_t part(vid_t const X) const { return entry(X).part; }
+  inline vid_t position(vid_t const X) const { return entry(X).pos; }
+
+  inline part_t edgePart(vid_t const X, vid_t const Y) const {
+    IndexEntry const X_entry = entry(X);
+    IndexEntry const Y_entry = entry(Y);
+    return X_entry.pos < Y_entry.pos ? X_entry.part : Y_entry.part;
+  }
+
+  /* BATCHED LOOKUPS
+   * These overlap the cache misses of a batch by prefetching ahead of it. */
+  inline void parts(vid_t const *const vids, size_t const count, part_t *const out) const {
+    #pragma omp parallel for if(count >= PARALLEL_BATCH)
+    for (size_t i = 0; i < count; ++i) {
+      if (i + PREFETCH_DISTANCE < count)
+        prefetch(vids[i + PREFETCH_DISTANCE]);
+      out[i] = part(vids[i]);
+    }
+  }
+
+  inline void edgeParts(vid_t const *const srcs, vid_t const *const dsts, size_t const count,
+      part_t *const out) const {
+    #pragma omp parallel for if(count >= PARALLEL_BATCH)
+    for (size_t i = 0; i < count; ++i) {
+      if (i + PREFETCH_DISTANCE < count) {
+        prefetch(srcs[i + PREFETCH_DISTANCE]);
+        prefetch(dsts[i + PREFETCH_DISTANCE]);
+      }
+      out[i] = edgePart(srcs[i], dsts[i]);
+    }
+  }
+};
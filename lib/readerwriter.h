@@ -29,7 +29,14 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdio>
+#include <deque>
 #include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
 #include "defs.h"
 
@@ -47,15 +54,20 @@ public:
   XS1Reader(char const *const filename) :
     stream(filename, std::ios::binary) {}
 
-  bool read(vid_t &X, vid_t &Y) {
-    if (!stream.eof()) {
-      stream.read((char*)&buf, sizeof(xs1));
+  bool read(vid_t &X, vid_t &Y, float &weight) {
+    if (stream.read((char*)&buf, sizeof(xs1))) {
       X = buf.tail;
       Y = buf.head;
+      weight = buf.weight;
       return true;
     }
     return false;
   }
+
+  bool read(vid_t &X, vid_t &Y) {
+    float weight;
+    return read(X, Y, weight);
+  }
 };
 
 class XS1Writer {
@@ -63,8 +75,8 @@ private:
   std::ofstream stream;
   xs1 buf;
 public:
-  XS1Writer(char const *const filename) :
-    stream(filename, std::ios::binary | std::ios::trunc) {
+  XS1Writer(char const *const filename, bool const append = false) :
+    stream(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc)) {
     buf.weight = 1.0;
   }
 
@@ -78,14 +90,38 @@ public:
 class SNAPReader {
 private:
   std::ifstream stream;
+
+  bool readPair(vid_t &X, vid_t &Y) {
+    bool result = (bool) (stream >> X);
+    result &= (bool) (stream >> Y);
+    return result;
+  }
+
 public:
   SNAPReader(char const *const filename) :
     stream(filename) {}
 
+  // The rest of the line, such as a weight column, is skipped.
   bool read(vid_t &X, vid_t &Y) {
-    bool result = (bool) (stream >> X);
-    result &= (bool) (stream >> Y);
-    return result;
+    if (!readPair(X, Y))
+      return false;
+    stream.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    return true;
+  }
+
+  // An optional third column on the line is the edge's weight; without one, edges weigh 1.
+  bool read(vid_t &X, vid_t &Y, float &weight) {
+    if (!readPair(X, Y))
+      return false;
+    weight = 1.0;
+    while (stream.peek() == ' ' || stream.peek() == '\t')
+      stream.get();
+    if (stream.peek() != '\n' && stream.peek() != std::char_traits<char>::eof() && !(stream >> weight)) {
+      stream.clear();
+      weight = 1.0;
+    }
+    stream.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    return true;
   }
 };
 
@@ -93,10 +129,94 @@ class SNAPWriter {
 private:
   std::ofstream stream;
 public:
-  SNAPWriter(char const *const filename) :
-    stream(filename, std::ios::trunc) {}
+  SNAPWriter(char const *const filename, bool const append = false) :
+    stream(filename, append ? std::ios::app : std::ios::trunc) {}
 
   void write(vid_t const X, vid_t const Y) {
-    stream << X << ' ' << Y << std::endl;
+    stream << X << ' ' << Y << '\n';
+  }
+};
+
+/* Writes each part's edges to its own file, $PREFIX%04d, for any number of parts.
+ * Edges are buffered per part and written a block at a time through a bounded pool of open writers,
+ * so the number of open files never exceeds max_open however many parts there are.
+ * The first block of a part truncates its file and later blocks append, so edges keep their order. */
+template <typename WriterType>
+class PartitionWriter {
+private:
+  struct Edge { vid_t X; vid_t Y; };
+
+  std::string const prefix;
+  size_t const max_open;
+  size_t const block_edges;
+  size_t const max_buffered;
+
+  std::vector< std::vector<Edge> > buffers;
+  std::vector<WriterType*> writers;
+  std::vector<bool> started;
+  std::deque<size_t> open_parts;
+  size_t buffered;
+
+  WriterType* writer(size_t const part) {
+    if (writers[part] == nullptr) {
+      if (open_parts.size() == max_open) {
+        delete writers[open_parts.front()];
+        writers[open_parts.front()] = nullptr;
+        open_parts.pop_front();
+      }
+      std::vector<char> filename(prefix.size() + 24);
+      sprintf(filename.data(), "%s%04zu", prefix.c_str(), part);
+      writers[part] = new WriterType(filename.data(), started[part]);
+      started[part] = true;
+      open_parts.push_back(part);
+    }
+    return writers[part];
+  }
+
+  void flush(size_t const part) {
+    WriterType *const part_writer = writer(part);
+    for (Edge const &edge : buffers[part])
+      part_writer->write(edge.X, edge.Y);
+    buffered -= buffers[part].size();
+    std::vector<Edge>().swap(buffers[part]);
+  }
+
+  static size_t default_max_open() {
+    long const limit = sysconf(_SC_OPEN_MAX);
+    return limit > 0 ? std::max<size_t>(1, std::min<size_t>(limit / 2, KILO)) : 64;
+  }
+
+public:
+  PartitionWriter(char const *const output_prefix, size_t const num_parts,
+      size_t const max_open = default_max_open(), size_t const block_edges = 16 * KILO,
+      size_t const max_buffered = 16 * MEGA) :
+    prefix(output_prefix), max_open(max_open), block_edges(block_edges), max_buffered(max_buffered),
+    buffers(num_parts), writers(num_parts, nullptr), started(num_parts, false), open_parts(), buffered(0) {}
+
+  PartitionWriter(PartitionWriter const &other) = delete;
+  PartitionWriter& operator=(PartitionWriter const &other) = delete;
+
+  ~PartitionWriter() {
+    // Every part gets a file, even if it has no edges.
+    for (size_t part = 0; part != buffers.size(); ++part)
+      if (!buffers[part].empty() || !started[part])
+        flush(part);
+    for (size_t const part : open_parts)
+      delete writers[part];
+  }
+
+  inline void write(size_t const part, vid_t const X, vid_t const Y) {
+    buffers.at(part).push_back(Edge{X, Y});
+    ++buffered;
+
+    // Once too much is buffered, drain everything; each part still goes out as one block.
+    if (buffers[part].size() == block_edges) {
+      flush(part);
+    }
+    else if (buffered == max_buffered) {
+      for (size_t p = 0; p != buffers.size(); ++p)
+        if (!buffers[p].empty())
+          flush(p);
+    }
   }
 };
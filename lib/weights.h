@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2015
+ *      The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <vector>
+
+#include "defs.h"
+#include "readerwriter.h"
+
+/* INPUT WEIGHTS
+ * By default a partition balances weights derived from the tree's topology (see Partition::jnodeWeights).
+ * These read the actual costs from the input instead: a weight per vertex from a vertex weight file,
+ * and a weight per edge from the graph file (the xs1 weight field, or a third column in a text edge list).
+ * Weights are kept integral: each is multiplied by scale and rounded, so fractional weights need a scale
+ * large enough to tell them apart. */
+inline size_t roundWeight(double const weight, double const scale) {
+  return weight > 0.0 ? (size_t) std::llround(weight * scale) : 0;
+}
+
+/* A vertex weight file has one "vid weight" pair per line. Vertices it does not list weigh default_weight,
+ * and vids of num_vids or more are ignored. The result is vid-indexed. */
+std::vector<size_t> readVertexWeights(char const *const filename, size_t const num_vids,
+    size_t const default_weight = 1, double const scale = 1.0) {
+  std::ifstream stream(filename);
+  std::vector<size_t> weights(num_vids, default_weight);
+
+  vid_t X;
+  double weight;
+  while (stream >> X >> weight)
+    if (X < num_vids)
+      weights[X] = roundWeight(weight, scale);
+  return weights;
+}
+
+/* Each edge's weight goes to its ECV(down) owner, the endpoint that comes first in seq, just as pst_weight
+ * counts the edges each jnode owns. The result is indexed by position in seq, like jnode weights,
+ * so it can stand in for (or add to) the pst weights of a tree made with seq. Self-loops are ignored. */
+template <typename ReaderType>
+std::vector<size_t> downEdgeWeights_template(char const *const filename, std::vector<vid_t> const &seq,
+    double const scale) {
+  std::vector<vid_t> pos(*std::max_element(seq.cbegin(), seq.cend()) + 1, INVALID_VID);
+  for (size_t i = 0; i != seq.size(); ++i)
+    pos[seq[i]] = i;
+
+  ReaderType reader(filename);
+  std::vector<size_t> weights(seq.size(), 0);
+  vid_t X, Y;
+  float weight;
+  while (reader.read(X, Y, weight)) {
+    if (X == Y || X >= pos.size() || Y >= pos.size())
+      continue;
+    weights[std::min(pos[X], pos[Y])] += roundWeight(weight, scale);
+  }
+  return weights;
+}
+
+std::vector<size_t> downEdgeWeights(char const *const filename, std::vector<vid_t> const &seq,
+    double const scale = 1.0) {
+  return (strcmp(".dat", filename + strlen(filename) - 4) == 0) ?
+    downEdgeWeights_template<XS1Reader>(filename, seq, scale) :
+    downEdgeWeights_template<SNAPReader>(filename, seq, scale);
+}
+
+/* The sum of the weights of each vertex's edges, vid-indexed. This is the edge-weighted analogue of degree,
+ * which is what an edge-balanced Fennel balances. */
+template <typename ReaderType>
+std::vector<size_t> weightedDegrees_template(char const *const filename, double const scale) {
+  ReaderType reader(filename);
+  std::vector<size_t> degrees;
+  vid_t X, Y;
+  float weight;
+  while (reader.read(X, Y, weight)) {
+    size_t const required_size = std::max(X, Y) + 1;
+    if (degrees.size() < required_size)
+      degrees.resize(required_size, 0);
+    degrees[X] += roundWeight(weight, scale);
+    degrees[Y] += roundWeight(weight, scale);
+  }
+  return degrees;
+}
+
+std::vector<size_t> weightedDegrees(char const *const filename, double const scale = 1.0) {
+  return (strcmp(".dat", filename + strlen(filename) - 4) == 0) ?
+    weightedDegrees_template<XS1Reader>(filename, scale) :
+    weightedDegrees_template<SNAPReader>(filename, scale);
+}
+
+/* PART CAPACITIES
+ * A capacity file lists each part's relative capacity (e.g. its machine's speed), in part order,
+ * one per line; see Partition::capacities. Only the ratios matter. */
+std::vector<double> readCapacities(char const *const filename) {
+  std::ifstream stream(filename);
+  std::vector<double> capacities;
+
+  double capacity;
+  while (stream >> capacity) {
+    if (!(capacity > 0.0)) {
+      fprintf(stderr, "ERROR: Part %zu of %s has capacity %f; capacities must be positive.\n",
+          capacities.size(), filename, capacity);
+      throw std::bad_alloc();
+    }
+    capacities.push_back(capacity);
+  }
+  if (capacities.empty()) {
+    fprintf(stderr, "ERROR: %s lists no capacities.\n", filename);
+    throw std::bad_alloc();
+  }
+  return capacities;
+}
@@ -40,10 +40,11 @@ int main(int argc, char* argv[]) {
   bool verbose = false;
   bool make_kids = false;
   bool do_faqs = false;
+  bool verify_trees = false;
 
   opterr = 0;
   int opt;
-  while ((opt = getopt(argc, argv, "o:vkf")) != -1) {
+  while ((opt = getopt(argc, argv, "o:vkfV")) != -1) {
     switch (opt) {
       case 'o':
         output_filename = optarg;
@@ -57,6 +58,9 @@ int main(int argc, char* argv[]) {
       case 'f':
         do_faqs = !do_faqs;
         break;
+      case 'V':
+        verify_trees = !verify_trees;
+        break;
       case '?':
         if (optopt == 'o')
           printf("Option -%c requires a string.\n", optopt);
@@ -75,22 +79,24 @@ int main(int argc, char* argv[]) {
    
   auto start_point = std::chrono::steady_clock::now();
 
-  JNodeTable lhs(argv[optind]);
-  JNodeTable rhs(argv[optind + 1]);
+  JNodeTable lhs(argv[optind], verify_trees);
+  JNodeTable rhs(argv[optind + 1], verify_trees);
 
   auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
       std::chrono::steady_clock::now() - start_point);
   if (verbose) printf("Loaded in: %lums\n", load_duration.count());
 
-  JNodeTable jnodes = strcmp(output_filename, "") == 0 ?
-    JNodeTable(lhs.size(), make_kids, 0) :
-    JNodeTable(output_filename, lhs.size(), make_kids, 0);
-  jnodes.merge(lhs, rhs, make_kids);
+  JNodeTable jnodes(lhs.size(), make_kids, 0);
+  jnodes.parallel_merge(lhs, rhs, make_kids);
 
   auto build_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
       (std::chrono::steady_clock::now() - start_point) - load_duration);
   if (verbose) printf("Built in: %lums\n", build_duration.count());
 
+  // Merged partials are usually still sparse, so save() rather than mapping a dense output.
+  if (strcmp(output_filename, "") != 0)
+    jnodes.save(output_filename);
+
   if (do_faqs) {
     JNodeTable::Facts faq = jnodes.getFacts();
     faq.print();
@@ -28,6 +28,9 @@
  */
 
 #include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <unistd.h>
 #include <vector>
 
@@ -36,23 +39,94 @@
 #include <jnode.h>
 #include <partition.h>
 #include <sequence.h>
+#include <weights.h>
+
+/* A configuration is a part count with an optional balance factor, as in 64:1.05,
+ * or a hierarchy of part counts with a balance factor per level, as in 4x2x8:1.01,1.03,1.05.
+ * A single balance factor applies to every level. */
+struct Config {
+  std::vector<part_t> fanouts;
+  std::vector<double> balance_factors;
+
+  // Returns false if the configuration is malformed, has a balance factor under 1,
+  // or needs more parts than part_t can hold.
+  bool parse(char const *const arg, double const default_balance) {
+    char *itr = const_cast<char*>(arg);
+    long long total_parts = 1;
+    do {
+      long long const fanout = strtoll(itr, &itr, 10);
+      if (fanout < 1 || (total_parts *= fanout) > std::numeric_limits<part_t>::max())
+        return false;
+      fanouts.push_back(fanout);
+    } while (*itr == 'x' && ++itr);
+
+    if (*itr == ':') {
+      do {
+        char *const start = itr + 1;
+        double const balance_factor = strtod(start, &itr);
+        if (itr == start || !(balance_factor >= 1.0))
+          return false;
+        balance_factors.push_back(balance_factor);
+      } while (*itr == ',');
+    }
+    if (balance_factors.size() <= 1)
+      balance_factors.assign(fanouts.size(), balance_factors.empty() ? default_balance : balance_factors[0]);
+    return *itr == '\0' && balance_factors.size() == fanouts.size();
+  }
+
+  Partition partition(std::vector<vid_t> const &seq, JNodeTable const &jnodes,
+      Partition::Sweep const &sweep, bool const parallel, Partition const *const previous,
+      std::vector< std::vector<size_t> > const &dimensions, std::vector<double> const &capacities,
+      bool const split_hubs) const {
+    if (!capacities.empty())
+      return Partition(seq, jnodes, sweep, capacities, balance_factors[0], parallel, split_hubs);
+    if (!dimensions.empty())
+      return Partition(seq, jnodes, dimensions, fanouts[0], balance_factors[0]);
+    if (previous != nullptr)
+      return Partition(seq, jnodes, sweep, *previous, fanouts[0], balance_factors[0]);
+    return fanouts.size() == 1 ?
+      Partition(seq, jnodes, sweep, fanouts[0], balance_factors[0], parallel, split_hubs) :
+      Partition(seq, jnodes, sweep, fanouts, balance_factors);
+  }
+
+  // The balance factor of the leaf parts against the whole tree.
+  double balance() const {
+    double result = 1.0;
+    for (double const balance_factor : balance_factors)
+      result *= balance_factor;
+    return result;
+  }
+};
 
 int main(int argc, char* argv[]) {
 
   bool verbose = true;
   bool do_faqs = false;
+  bool verify_tree = false;
 
   double balance_factor = 1.03;
   bool vtx_weight = false;
   bool pst_weight = false;
   bool pre_weight = false;
+  char const *edge_weight_filename = "";
+  char const *vertex_weight_filename = "";
+  double weight_scale = 1.0;
+  bool multi_constraint = false;
+  char const *capacity_filename = "";
+  bool split_hubs = false;
+  bool mirror_tables = false;
+  bool parallel = false;
+  bool concurrent = false;
+  int refine_rounds = 0;
 
   char const *graph_filename = "";
   char const *output_filename = "";
+  char const *index_filename = "";
+  char const *previous_filename = "";
 
   opterr = 0;
   int opt;
-  while ((opt = getopt(argc, argv, "vfb:xdug:o:")) != -1) {
+  while ((opt = getopt(argc, argv, "vfVb:xdue:w:s:MC:HRpcr:g:o:i:m:")) != -1) {
     switch (opt) {
       case 'v':
         verbose = !verbose;
@@ -60,6 +134,9 @@ int main(int argc, char* argv[]) {
       case 'f':
         do_faqs = !do_faqs;
         break;
+      case 'V':
+        verify_tree = !verify_tree;
+        break;
       case 'b':
         balance_factor = atof(optarg);
         break;
@@ -72,18 +149,55 @@ int main(int argc, char* argv[]) {
       case 'u':
         pre_weight = true;
         break;
+      case 'e':
+        edge_weight_filename = optarg;
+        break;
+      case 'w':
+        vertex_weight_filename = optarg;
+        break;
+      case 's':
+        weight_scale = atof(optarg);
+        break;
+      case 'M':
+        multi_constraint = !multi_constraint;
+        break;
+      case 'C':
+        capacity_filename = optarg;
+        break;
+      case 'H':
+        split_hubs = !split_hubs;
+        break;
+      case 'R':
+        mirror_tables = !mirror_tables;
+        break;
+      case 'p':
+        parallel = !parallel;
+        break;
+      case 'c':
+        concurrent = !concurrent;
+        break;
+      case 'r':
+        refine_rounds = atoi(optarg);
+        break;
       case 'g':
         graph_filename = optarg;
         break;
       case 'o':
         output_filename = optarg;
         break;
+      case 'i':
+        index_filename = optarg;
+        break;
+      case 'm':
+        previous_filename = optarg;
+        break;
       case '?':
-        if (optopt == 'k')
+        if (optopt == 'k' || optopt == 'r')
           printf("Option -%c requires a long long.\n", optopt);
-        else if (optopt == 'b')
+        else if (optopt == 'b' || optopt == 's')
           printf("Option -%c requires a double.\n", optopt);
-        else if (optopt == 'g' || optopt == 'o')
+        else if (optopt == 'g' || optopt == 'o' || optopt == 'i' || optopt == 'm' || optopt == 'e' || optopt == 'w' ||
+            optopt == 'C')
           printf("Option -%c requires a string.\n", optopt);
         else
           printf("Unknown option character '\\x%x'.\n", optopt);
@@ -92,17 +206,68 @@ int main(int argc, char* argv[]) {
         abort();
     }
   }
-  if (!(vtx_weight || pst_weight || pre_weight))
+  if (multi_constraint && (strcmp(previous_filename, "") != 0 || refine_rounds != 0)) {
+    printf("-M cannot be combined with -m or -r, which balance a single weight.\n");
+    return 1;
+  }
+  if (strcmp(capacity_filename, "") != 0 && (multi_constraint || strcmp(previous_filename, "") != 0)) {
+    printf("-C cannot be combined with -M or -m, which make equal parts.\n");
+    return 1;
+  }
+  if (split_hubs && (multi_constraint || strcmp(previous_filename, "") != 0 || refine_rounds != 0 ||
+        strcmp(index_filename, "") != 0)) {
+    printf("-H cannot be combined with -M, -m, -r or -i, which place whole vertices.\n");
+    return 1;
+  }
+  if (refine_rounds != 0 && strcmp(graph_filename, "") == 0) {
+    printf("-r needs -g, since refinement reads the graph.\n");
+    return 1;
+  }
+  if (!(vtx_weight || pst_weight || pre_weight) &&
+      strcmp(edge_weight_filename, "") == 0 && strcmp(vertex_weight_filename, "") == 0)
     pst_weight = true;
 
   if (optind + 2 >= argc) {
-    printf("USAGE: partition_tree [options] input_sequence input_tree parts [parts...]\n");
+    printf("USAGE: partition_tree [options] input_sequence input_tree parts[xparts...][:balance[,balance...]] [...]\n");
     return 1;
   }
+  // With -C, the parts are sized by capacity, and every part count must be the number of capacities.
+  std::vector<double> const capacities = strcmp(capacity_filename, "") != 0 ?
+    readCapacities(capacity_filename) : std::vector<double>();
+
+  std::vector<Config> configs(argc - (optind + 2));
+  for (int i = optind + 2; i != argc; ++i) {
+    if (!configs[i - (optind + 2)].parse(argv[i], balance_factor)) {
+      printf("Cannot make %s parts; is it malformed, is a balance factor under 1, or is it past part ids' limit of %lld (see USE_WIDE_PARTS in lib/defs.h)?\n",
+          argv[i], (long long) std::numeric_limits<part_t>::max());
+      return 1;
+    }
+    if (strcmp(previous_filename, "") != 0 && configs[i - (optind + 2)].fanouts.size() != 1) {
+      printf("Cannot repartition into %s parts; -m only supports flat part counts.\n", argv[i]);
+      return 1;
+    }
+    if (multi_constraint && configs[i - (optind + 2)].fanouts.size() != 1) {
+      printf("Cannot make %s parts; -M only supports flat part counts.\n", argv[i]);
+      return 1;
+    }
+    if (parallel && configs[i - (optind + 2)].fanouts.size() != 1) {
+      printf("Cannot make %s parts; -p only supports flat part counts.\n", argv[i]);
+      return 1;
+    }
+    if (split_hubs && configs[i - (optind + 2)].fanouts.size() != 1) {
+      printf("Cannot make %s parts; -H only supports flat part counts.\n", argv[i]);
+      return 1;
+    }
+    if (!capacities.empty() && (configs[i - (optind + 2)].fanouts.size() != 1 ||
+          (size_t) configs[i - (optind + 2)].fanouts[0] != capacities.size())) {
+      printf("Cannot make %s parts; %s lists %zu capacities.\n", argv[i], capacity_filename, capacities.size());
+      return 1;
+    }
+  }
    
   auto start_point = std::chrono::steady_clock::now();
 
-  JNodeTable jnodes(argv[optind + 1]);
+  JNodeTable jnodes(argv[optind + 1], verify_tree);
 
   auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
       std::chrono::steady_clock::now() - start_point);
@@ -111,55 +276,170 @@ int main(int argc, char* argv[]) {
   if (do_faqs)
     jnodes.getFacts().print();
 
+  // With -m, every partition is a repartition that moves as little as it can from the previous one.
+  std::unique_ptr<Partition> previous;
+  if (strcmp(previous_filename, "") != 0)
+    previous.reset(new Partition(PartitionIndex(previous_filename)));
+
+  /* Every remaining argument is a part count, optionally with its own balance factor, as in 64:1.05.
+   * The jnode weights and kid order are worked out once for the whole sweep, and with -c its partitions are
+   * computed concurrently, one batch of OMP_NUM_THREADS configurations at a time.
+   * The topological weights are summed with any input weights, which need the sequence. */
+  std::vector<size_t> weights = (vtx_weight || pst_weight || pre_weight) ?
+    Partition::jnodeWeights(jnodes, vtx_weight, pst_weight, pre_weight) :
+    std::vector<size_t>(jnodes.size(), 0);
+
+  /* With -M, each kind of weight is balanced on its own instead of in the sum. */
+  std::vector< std::vector<size_t> > dimensions;
+  std::vector<char const*> dimension_names;
+  if (multi_constraint) {
+    if (vtx_weight) {
+      dimensions.push_back(Partition::jnodeWeights(jnodes, true, false, false));
+      dimension_names.push_back("Vertex");
+    }
+    if (pst_weight) {
+      dimensions.push_back(Partition::jnodeWeights(jnodes, false, true, false));
+      dimension_names.push_back("Post-edge");
+    }
+    if (pre_weight) {
+      dimensions.push_back(Partition::jnodeWeights(jnodes, false, false, true));
+      dimension_names.push_back("Pre-edge");
+    }
+  }
+
+  auto add_input_weights = [&](std::vector<vid_t> const &seq) {
+    assert(seq.size() == weights.size());
+    if (strcmp(edge_weight_filename, "") != 0) {
+      std::vector<size_t> edge_weights = downEdgeWeights(edge_weight_filename, seq, weight_scale);
+      for (size_t i = 0; i != seq.size(); ++i)
+        weights[i] += edge_weights[i];
+      if (multi_constraint) {
+        dimensions.push_back(std::move(edge_weights));
+        dimension_names.push_back("Edge weight");
+      }
+    }
+    if (strcmp(vertex_weight_filename, "") != 0) {
+      std::vector<size_t> const vertex_weights = readVertexWeights(vertex_weight_filename,
+          *std::max_element(seq.cbegin(), seq.cend()) + 1, 1, weight_scale);
+      for (size_t i = 0; i != seq.size(); ++i)
+        weights[i] += vertex_weights[seq[i]];
+      if (multi_constraint) {
+        dimensions.emplace_back(seq.size());
+        for (size_t i = 0; i != seq.size(); ++i)
+          dimensions.back()[i] = vertex_weights[seq[i]];
+        dimension_names.push_back("Vertex weight");
+      }
+    }
+  };
+
+  auto print_migration = [&](Partition const &part, std::vector<vid_t> const &seq) {
+    size_t total_weight = 0;
+    for (size_t const weight : weights)
+      total_weight += weight;
+    size_t const moved = part.migration(seq, weights, *previous);
+    printf("Migration moved %zu of %zu weight (%f%%)\n", moved, total_weight, 100.0 * moved / total_weight);
+  };
+
+  auto sweep = [&](std::vector<vid_t> const &seq, std::function<void(Partition &, double)> const &report) {
+    Partition::Sweep const shared(jnodes, weights);
+    int const batch = concurrent ? omp_get_max_threads() : 1;
+    std::vector<Partition> batch_parts(batch);
+    std::vector<double> batch_balance(batch);
+    std::vector<double> batch_seconds(batch);
+
+    for (int beg = optind + 2; beg < argc; beg += batch) {
+      int const end = std::min(argc, beg + batch);
+
+      #pragma omp parallel for schedule(dynamic, 1) if(concurrent)
+      for (int i = beg; i < end; ++i) {
+        Config const &config = configs[i - (optind + 2)];
+        batch_balance[i - beg] = config.balance();
+
+        auto partition_start = std::chrono::steady_clock::now();
+
+        batch_parts[i - beg] = config.partition(seq, jnodes, shared, parallel, previous.get(), dimensions, capacities, split_hubs);
+
+        batch_seconds[i - beg] = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - partition_start).count() / 1000.0;
+      }
+
+      for (int i = beg; i != end; ++i) {
+        if (verbose) printf("Partitioning took: %f seconds\n", batch_seconds[i - beg]);
+        if (previous)
+          print_migration(batch_parts[i - beg], seq);
+        for (size_t d = 0; d != dimensions.size(); ++d)
+          printf("%s balance: %f\n", dimension_names[d], batch_parts[i - beg].balance(seq, dimensions[d]));
+        report(batch_parts[i - beg], batch_balance[i - beg]);
+      }
+    }
+  };
+
   /* SIMPLE PARTITIONING */
-  if (strcmp(graph_filename, "") == 0) {
+  if (strcmp(graph_filename, "") == 0 && strcmp(index_filename, "") == 0) {
     std::vector<vid_t> seq = readSequence(argv[optind]);
-    for (int i = optind + 2; i != argc; ++i) {
-      short const num_parts = atoi(argv[optind + 2]);
-      Partition part(seq, jnodes, num_parts, balance_factor, vtx_weight, pst_weight, pre_weight);
+    add_input_weights(seq);
+    sweep(seq, [](Partition &part, double) {
       part.print();
-    }
+    });
   }
   /* PARTITIONING AND EVALUATION */
-  else if (strcmp(output_filename, "") == 0) {
+  else if (strcmp(output_filename, "") == 0 && strcmp(index_filename, "") == 0) {
     GraphWrapper graph(graph_filename);
     std::vector<vid_t> seq = strcmp(argv[optind], "-") == 0 ?
       degreeSequence(graph) :
       readSequence(argv[optind]);
+    add_input_weights(seq);
 
-    for (int i = optind + 2; i != argc; ++i) {
-      short const num_parts = atoi(argv[i]);
-
-      auto partition_start = std::chrono::steady_clock::now();
-
-      Partition part(seq, jnodes, num_parts, balance_factor, vtx_weight, pst_weight, pre_weight);
-
-      auto partition_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::steady_clock::now() - partition_start);
-      if (verbose) printf("Partitioning took: %f seconds\n", partition_duration.count() / 1000.0);
-
+    sweep(seq, [&](Partition &part, double const config_balance) {
+      if (refine_rounds != 0) {
+        auto refine_start = std::chrono::steady_clock::now();
+        size_t const moved = part.refine(graph, seq, weights, config_balance, refine_rounds);
+        auto refine_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - refine_start);
+        if (verbose) printf("Refinement moved %zu vertices in: %f seconds\n", moved, refine_duration.count() / 1000.0);
+      }
       part.print();
+      if (strcmp(edge_weight_filename, "") != 0 || strcmp(vertex_weight_filename, "") != 0)
+        printf("Input weight balance: %f\n", part.balance(seq, weights));
       part.evaluate(graph, seq);
-    }
+    });
   }
   /* PARTITIONING AND I/O */
   else {
     std::vector<vid_t> seq = strcmp(argv[optind], "-") == 0 ?
       fileSequence(graph_filename) :
       readSequence(argv[optind]);
-
-    short const num_parts = atoi(argv[optind + 2]);
+    add_input_weights(seq);
 
     auto partition_start = std::chrono::steady_clock::now();
 
-    Partition part(seq, jnodes, num_parts, balance_factor, vtx_weight, pst_weight, pre_weight);
+    Partition part = configs[0].partition(seq, jnodes, Partition::Sweep(jnodes, weights), parallel, previous.get(),
+        dimensions, capacities, split_hubs);
 
     auto partition_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     std::chrono::steady_clock::now() - partition_start);
     if (verbose) printf("Partitioning took: %f seconds\n", partition_duration.count() / 1000.0);
+    if (refine_rounds != 0) {
+      auto refine_start = std::chrono::steady_clock::now();
+      GraphWrapper graph(graph_filename);
+      size_t const moved = part.refine(graph, seq, weights, configs[0].balance(), refine_rounds);
+      auto refine_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - refine_start);
+      if (verbose) printf("Refinement moved %zu vertices in: %f seconds\n", moved, refine_duration.count() / 1000.0);
+    }
+    if (previous)
+      print_migration(part, seq);
+    for (size_t d = 0; d != dimensions.size(); ++d)
+      printf("%s balance: %f\n", dimension_names[d], part.balance(seq, dimensions[d]));
 
     part.print();
-    part.writePartitionedGraph(graph_filename, seq, output_filename);
+    if (strcmp(index_filename, "") != 0)
+      part.writeIndex(seq, index_filename);
+    if (strcmp(graph_filename, "") != 0 && strcmp(output_filename, "") != 0) {
+      part.writePartitionedGraph(graph_filename, seq, output_filename);
+      if (mirror_tables)
+        part.writeMirrorTables(graph_filename, seq, output_filename);
+    }
   }
 
   auto run_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
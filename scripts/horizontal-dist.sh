@@ -1,5 +1,22 @@
 #!/bin/bash
 
+# NATIVE
+# Without SLURM or MPI every stage runs on this host, so one process drives them all without polling.
+# It merges partial trees in the order they finish, not in reduce-worker.sh's fixed pairs.
+# As in part-worker.sh, PARTS=0 skips partitioning.
+# It leaves ${PREFIX}.tre, and ${PREFIX}.seq if it sorted, just as the stages below do.
+if [ "$RUN" = '' ] && [ $USE_MPI_SORT -eq $FALSE ] && [ $USE_MPI_REDUCE -eq $FALSE ]; then
+  # SEQ_FILE stays '-', so the next trial sorts again rather than reading a removed directory.
+  NATIVE_SEQ=$( [ $SEQ_FILE != '-' ] && echo "-s $SEQ_FILE" || echo "-S ${PREFIX}.seq")
+  NATIVE_OUT=$( [ "$OUT_FILE" != '' ] && echo "-o $OUT_FILE" || echo '')
+  NATIVE_FAQS=$( [ "$PARTS" != 0 ] && echo '-f' || echo '')
+  ./dist_partition -w $WORKERS -c $CORES $NATIVE_SEQ -t "${PREFIX}.tre" $NATIVE_OUT $NATIVE_FAQS $VERBOSE \
+    $GRAPH $PARTS
+  return
+fi
+
+
+
 # SETUP
 if [ $SEQ_FILE = '-' ]; then
   export SEQ_FILE="${PREFIX}.seq"
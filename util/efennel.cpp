@@ -39,14 +39,14 @@
 int main(int argc, char* argv[]) {
 
   if (argc < 3) {
-    printf("USAGE: fennel graph parts [parts...]\n");
+    printf("USAGE: efennel graph parts [parts...]\n");
     return 1;
   }
    
   auto start_point = std::chrono::steady_clock::now();
 
   for (int i = 2; i != argc; ++i) {
-    short const num_parts = atoi(argv[i]);
+    part_t const num_parts = atoi(argv[i]);
 
     auto partition_start = std::chrono::steady_clock::now();
 
@@ -56,6 +56,8 @@ int main(int argc, char* argv[]) {
     auto partition_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
     std::chrono::steady_clock::now() - partition_start);
     printf("Partitioning took: %lums\n", partition_duration.count());
+
+    part.evaluateEdges(argv[1]);
   }
 
   auto run_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015
+ *      The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <defs.h>
+#include <partition_index.h>
+
+/* Reads one query per line from stdin, either a vertex X or an edge X Y, and prints its part.
+ * Queries are answered in batches, so a stream of them runs at the batched lookup rate. */
+int main(int argc, char* argv[]) {
+
+  if (argc != 2) {
+    printf("USAGE: query_partition index < queries\n");
+    return 1;
+  }
+
+  auto start_point = std::chrono::steady_clock::now();
+
+  PartitionIndex index(argv[1]);
+
+  auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start_point);
+  fprintf(stderr, "Loaded in: %lums\n", load_duration.count());
+  fprintf(stderr, "Vertices:%zu Parts:%d\n", index.size(), index.numParts());
+
+  // A vertex query is the edge X X, which ECV(down) puts in X's part.
+  size_t const batch = 64 * KILO;
+  std::vector<vid_t> srcs, dsts;
+  std::vector<part_t> parts(batch);
+  srcs.reserve(batch);
+  dsts.reserve(batch);
+
+  auto flush = [&]() {
+    index.edgeParts(srcs.data(), dsts.data(), srcs.size(), parts.data());
+    for (size_t i = 0; i != srcs.size(); ++i)
+      printf("%d\n", parts[i]);
+    srcs.clear();
+    dsts.clear();
+  };
+
+  char line[256];
+  while (fgets(line, sizeof(line), stdin) != nullptr) {
+    unsigned long long X, Y;
+    int const fields = sscanf(line, "%llu %llu", &X, &Y);
+    if (fields < 1)
+      continue;
+    if (fields == 1)
+      Y = X;
+    srcs.push_back(std::min<unsigned long long>(X, INVALID_VID));
+    dsts.push_back(std::min<unsigned long long>(Y, INVALID_VID));
+    if (srcs.size() == batch)
+      flush();
+  }
+  flush();
+
+  return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015
+ *      The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <chrono>
+#include <unistd.h>
+
+#include <defs.h>
+#include <jnode.h>
+
+/* Rewrites a tree in this build's format. The input may be a headerless tree from before TreeHeader,
+ * which is read as this build's raw JNodes, or a tree written with other id or weight widths. */
+int main(int argc, char* argv[]) {
+
+  if (optind + 1 >= argc) {
+    printf("USAGE: upgrade_tree input_tree output_tree\n");
+    return 1;
+  }
+  char const *const input_filename = argv[optind];
+  char const *const output_filename = argv[optind + 1];
+
+  auto start_point = std::chrono::steady_clock::now();
+
+  JNodeTable jnodes(input_filename, true);
+
+  auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start_point);
+  printf("Loaded in: %lums\n", load_duration.count());
+
+  jnodes.save(output_filename);
+
+  auto save_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      (std::chrono::steady_clock::now() - start_point) - load_duration);
+  printf("Saved in: %lums\n", save_duration.count());
+
+  return 0;
+}
@@ -35,17 +35,71 @@
 #include <graph_wrapper.h>
 #include <partition.h>
 #include <sequence.h>
+#include <weights.h>
 
 int main(int argc, char* argv[]) {
 
-  if (argc < 3) {
-    printf("USAGE: vfennel graph parts [parts...]\n");
+  bool edge_weights = false;
+  char const *vertex_weight_filename = "";
+  double weight_scale = 1.0;
+  char const *capacity_filename = "";
+  bool parallel = false;
+  int restream_passes = 0;
+  double restream_threshold = 0.01;
+
+  opterr = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "ew:s:C:pr:t:")) != -1) {
+    switch (opt) {
+      case 'e':
+        edge_weights = !edge_weights;
+        break;
+      case 'w':
+        vertex_weight_filename = optarg;
+        break;
+      case 's':
+        weight_scale = atof(optarg);
+        break;
+      case 'C':
+        capacity_filename = optarg;
+        break;
+      case 'p':
+        parallel = !parallel;
+        break;
+      case 'r':
+        restream_passes = atoi(optarg);
+        break;
+      case 't':
+        restream_threshold = atof(optarg);
+        break;
+      case '?':
+        if (optopt == 'w' || optopt == 'C')
+          printf("Option -%c requires a string.\n", optopt);
+        else if (optopt == 's' || optopt == 't')
+          printf("Option -%c requires a double.\n", optopt);
+        else if (optopt == 'r')
+          printf("Option -%c requires an int.\n", optopt);
+        else
+          printf("Unknown option character '\\x%x'.\n", optopt);
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  if (restream_passes < 0) {
+    printf("Cannot restream %d times.\n", restream_passes);
+    return 1;
+  }
+
+  if (optind + 2 > argc) {
+    printf("USAGE: vfennel [-e] [-w vertex_weights] [-s weight_scale] [-C capacities] [-p] [-r passes] [-t threshold] graph parts [parts...]\n");
     return 1;
   }
    
   auto start_point = std::chrono::steady_clock::now();
 
-  GraphWrapper graph(argv[1]);
+  GraphWrapper graph(argv[optind]);
 
   auto load_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
       std::chrono::steady_clock::now() - start_point);
@@ -54,12 +108,39 @@ int main(int argc, char* argv[]) {
 
   std::vector<vid_t> seq = defaultSequence(graph);
 
-  for (int i = 2; i != argc; ++i) {
-    short const num_parts = atoi(argv[i]);
+  // -e balances the graph file's weighted degrees, and -w adds a weight per vertex; -s scales both.
+  std::vector<size_t> vertex_weights;
+  if (edge_weights) {
+    vertex_weights = weightedDegrees(argv[optind], weight_scale);
+    vertex_weights.resize(graph.getMaxVid() + 1, 0);
+  }
+  if (strcmp(vertex_weight_filename, "") != 0) {
+    std::vector<size_t> const file_weights = readVertexWeights(vertex_weight_filename, graph.getMaxVid() + 1, 1, weight_scale);
+    vertex_weights.resize(file_weights.size(), 0);
+    for (size_t X = 0; X != file_weights.size(); ++X)
+      vertex_weights[X] += file_weights[X];
+  }
+
+  // -C sizes each part by its capacity, so the part counts must match the capacity file.
+  std::vector<double> const capacities = strcmp(capacity_filename, "") != 0 ?
+    readCapacities(capacity_filename) : std::vector<double>();
+
+  for (int i = optind + 1; i != argc; ++i) {
+    part_t const num_parts = atoi(argv[i]);
+    if (!capacities.empty() && (size_t) num_parts != capacities.size()) {
+      printf("Cannot make %s parts; %s lists %zu capacities.\n", argv[i], capacity_filename, capacities.size());
+      return 1;
+    }
 
     auto partition_start = std::chrono::steady_clock::now();
 
-    Partition part(graph, seq, num_parts);
+    Partition part(graph, seq, num_parts, 1.03, true, vertex_weights, capacities, parallel);
+    // -r restreams up to that many more times, until a pass cuts under -t fewer of the edges left cut.
+    if (restream_passes != 0) {
+      int const passes = part.restream(graph, seq, restream_passes, restream_threshold, 1.03, true,
+          vertex_weights, parallel);
+      printf("Restreamed %d times.\n", passes);
+    }
     part.print();
 
     auto partition_duration = std::chrono::duration_cast<std::chrono::milliseconds>(